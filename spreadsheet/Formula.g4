@@ -6,9 +6,14 @@ main
 
 expr
     : '(' expr ')'  # Parens
+    | IF '(' expr ',' expr ',' expr ')'  # If
+    | VLOOKUP '(' expr ',' CELL ':' CELL ',' expr (',' expr)? ')'  # VLookup
+    | MATCH '(' expr ',' CELL ':' CELL (',' expr)? ')'  # Match
+    | INDEX '(' CELL ':' CELL ',' expr (',' expr)? ')'  # Index
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | expr (LT | LE | GT | GE | EQ | NE) expr  # Comparison
     | CELL  # Cell
     | NUMBER  # Literal
     ;
@@ -26,5 +31,15 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+EQ: '=' ;
+NE: '<>' ;
+IF: 'IF' ;
+VLOOKUP: 'VLOOKUP' ;
+MATCH: 'MATCH' ;
+INDEX: 'INDEX' ;
 CELL: [A-Z]+[0-9]+ ;
 WS: [ \t\n\r]+ -> skip ; 
\ No newline at end of file
@@ -1,18 +1,24 @@
 #include "FormulaAST.h"
 
+#include "column_index.h"
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <unordered_map>
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_CMP,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -49,50 +55,135 @@ enum PrecedenceRule {
 // grammatic precedence) A / (B * C) - never okay A / (B / C) - never okay
 // -(A + B) - never okay
 // -(A - B) - never okay
-// -(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
-// -(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// -(A * B) - **sometimes okay** (C / -(A * B) would be printed as C / -A * B, which parses as
+//     (C / -A) * B)
+//     (in the table we're always putting in the parentheses)
+// -(A / B) - **sometimes okay** (same)
 // +(A + B) - **sometimes okay** (e.g. parens in +(A + B) / C are **not** optional)
 //     (currently in the table we're always putting in the parentheses)
 // +(A - B) - **sometimes okay** (same)
 //     (currently in the table we're always putting in the parentheses)
-// +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
-// +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// +(A * B) - **sometimes okay** (same as -(A * B))
+// +(A / B) - **sometimes okay** (same)
+// Comparisons have the lowest grammatic precedence and are left-associative:
+// A < (B < C) - never okay, (A < B) < C - always okay,
+// any arithmetic operation or unary operator around a comparison - never okay.
+// IF arguments are printed as the root expression and never need parentheses.
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// Maps cell references of one AST onto the positions of another.
+using CellBinding = std::unordered_map<const Position*, const Position*>;
+
 class Expr {
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
+    // Appends the canonical text of the subtree; called once per AST, see FormulaAST.
+    virtual void DoPrintFormula(std::string& out, ExprPrecedence precedence) const = 0;
     virtual double Evaluate(const SheetInterface& sheet) const = 0;
 
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    // Returns a simplified copy of the subtree or nullptr if there is nothing to simplify.
+    // The copy is used for evaluation only, so it is free to lose the original structure.
+    virtual std::unique_ptr<Expr> Fold() const = 0;
+    virtual std::unique_ptr<Expr> Clone() const = 0;
+
+    // Points every cell reference of the subtree to its image in cells.
+    virtual void RebindCells(const CellBinding& cells) = 0;
+
+    // Appends the valid cell references that are read whichever IF branches are taken.
+    virtual void CollectRequiredCells(std::vector<Position>& cells) const = 0;
+
+    // Appends the cell ranges of the subtree, corners ordered and valid.
+    virtual void CollectRanges(std::vector<CellRange>& ranges) const = 0;
+
+    // The value of the subtree if it does not depend on the sheet.
+    virtual std::optional<double> GetConstant() const {
+        return std::nullopt;
+    }
+
+    // The cells added left to right by the subtree if it is A1 or A1+A2+...+An; empty otherwise.
+    virtual std::vector<const Position*> GetSummedCells() const {
+        return {};
+    }
+
+    // Whether Evaluate can only return finite numbers (or throw).
+    virtual bool IsFinite() const = 0;
+
+    // Size of the subtree in bytes.
+    virtual size_t GetMemoryUsage() const = 0;
+
+    void PrintFormula(std::string& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
         bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
         if (parens_needed) {
-            out << '(';
+            out += '(';
         }
 
         DoPrintFormula(out, precedence);
 
         if (parens_needed) {
-            out << ')';
+            out += ')';
         }
     }
 };
 
 namespace {
+void AppendCell(std::string& out, Position pos) {
+    if (!pos.IsValid()) {
+        out += FormulaError(FormulaError::Category::Ref).ToString();
+    } else {
+        char buffer[Position::MAX_STRING_LENGTH];
+        out.append(buffer, pos.ToChars(buffer));
+    }
+}
+
+// Same digits as operator<< with the default stream precedence: %g with 6 significant digits
+void AppendNumber(std::string& out, double value) {
+    char buffer[32];
+    const auto result = std::to_chars(std::begin(buffer), std::end(buffer), value,
+                                      std::chars_format::general, 6);
+    out.append(buffer, result.ptr);
+}
+
+// The value of a valid cell as a formula operand: empty cells read as 0.
+double GetCellNumber(const SheetInterface& sheet, Position pos) {
+    if (const auto number = sheet.GetNumber(pos)){
+        return *number;
+    }
+    const CellInterface* cell = sheet.GetCell(pos);
+    if (!cell){
+        return 0;
+    }
+
+    const CellInterface::Value value = cell -> GetValue();
+    if (std::holds_alternative<double>(value)){
+        return std::get<double>(value);
+    } else if (std::holds_alternative<std::string>(value)){
+        const std::string& text = std::get<std::string>(value);
+        if (text.empty()){
+            return 0;
+        }
+        if (const auto number = ParseCellNumber(text)){
+            return *number;
+        }
+        throw FormulaError(FormulaError::Category::Value);
+    } else {
+        throw std::get<FormulaError>(value);
+    }
+}
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -117,9 +208,9 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::string& out, ExprPrecedence precedence) const override {
         lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
+        out += static_cast<char>(type_);
         rhs_->PrintFormula(out, precedence, true);
     }
 
@@ -140,33 +231,78 @@ public:
     }
 
     double Evaluate(const SheetInterface& sheet) const override {
-        double number;
         double left_number = lhs_ -> Evaluate(sheet);
         double right_number = rhs_ -> Evaluate(sheet);
+        double number = Apply(left_number, right_number);
+
+        if (!std::isfinite(number)){
+            throw FormulaError(FormulaError::Category::Arithmetic);
+        }
+
+        return number;
+    }
+
+    std::unique_ptr<Expr> Fold() const override;
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(), rhs_->Clone());
+    }
+
+    void RebindCells(const CellBinding& cells) override {
+        lhs_->RebindCells(cells);
+        rhs_->RebindCells(cells);
+    }
+
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        lhs_->CollectRequiredCells(cells);
+        rhs_->CollectRequiredCells(cells);
+    }
 
+    void CollectRanges(std::vector<CellRange>& ranges) const override {
+        lhs_->CollectRanges(ranges);
+        rhs_->CollectRanges(ranges);
+    }
+
+    bool IsFinite() const override {
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+private:
+    double Apply(double left_number, double right_number) const {
         switch (type_){
             case Add:
-                number = left_number + right_number;
-                break;
+                return left_number + right_number;
             case Subtract:
-                number = left_number - right_number;
-                break;
+                return left_number - right_number;
             case Multiply:
-                number = left_number * right_number;
-                break;
-            case Divide:
-                number = left_number / right_number;
-                break;
+                return left_number * right_number;
+            default:
+                return left_number / right_number;
         }
+    }
 
-        if (!std::isfinite(number)){
-            throw FormulaError(FormulaError::Category::Arithmetic);
+    // Checks if the operation returns the kept operand bit for bit: x*1, 1*x, x/1 and x-(+0).
+    // x+0 is not an identity because -0+0 is +0.
+    bool IsIdentity(std::optional<double> constant, bool right_constant) const {
+        if (!constant) {
+            return false;
+        }
+        switch (type_){
+            case Multiply:
+                return *constant == 1;
+            case Divide:
+                return right_constant && *constant == 1;
+            case Subtract:
+                return right_constant && *constant == 0 && !std::signbit(*constant);
+            default:
+                return false;
         }
-
-        return number;
     }
 
-private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
     std::unique_ptr<Expr> rhs_;
@@ -191,8 +327,8 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
+    void DoPrintFormula(std::string& out, ExprPrecedence precedence) const override {
+        out += static_cast<char>(type_);
         operand_->PrintFormula(out, precedence);
     }
 
@@ -209,6 +345,32 @@ public:
         }
     }
 
+    std::unique_ptr<Expr> Fold() const override;
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<UnaryOpExpr>(type_, operand_->Clone());
+    }
+
+    void RebindCells(const CellBinding& cells) override {
+        operand_->RebindCells(cells);
+    }
+
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        operand_->CollectRequiredCells(cells);
+    }
+
+    void CollectRanges(std::vector<CellRange>& ranges) const override {
+        operand_->CollectRanges(ranges);
+    }
+
+    bool IsFinite() const override {
+        return operand_->IsFinite();
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + operand_->GetMemoryUsage();
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
@@ -224,12 +386,13 @@ public:
         if (!cell_->IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
-            out << cell_->ToString();
+            char buffer[Position::MAX_STRING_LENGTH];
+            out.write(buffer, cell_->ToChars(buffer) - buffer);
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::string& out, ExprPrecedence /* precedence */) const override {
+        AppendCell(out, *cell_);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -240,34 +403,43 @@ public:
         if (!cell_ -> IsValid()){
             throw FormulaError(FormulaError::Category::Ref);
         }
-        const CellInterface* cell = sheet.GetCell(*cell_);
-        if (!cell){
-            return 0;
-        }
+        return GetCellNumber(sheet, *cell_);
+    }
 
-        const CellInterface::Value value = cell -> GetValue();
-        if (std::holds_alternative<double>(value)){
-            return std::get<double>(value);
-        } else if (std::holds_alternative<std::string>(value)){
-            const std::string text = std::get<std::string>(value);
-            if (text.empty()){
-                return 0;
-            }
-            try {
-                std::size_t end_pos{};
-                const double d_value = std::stod(text, &end_pos);
-                if (end_pos != text.size()){
-                    throw std::exception();
-                }
-                return d_value;
-            } catch (const std::exception&){
-                throw FormulaError(FormulaError::Category::Value);
-            }
-        } else {
-            throw std::get<FormulaError>(value);
+    std::unique_ptr<Expr> Fold() const override {
+        return nullptr;
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<CellExpr>(cell_);
+    }
+
+    void RebindCells(const CellBinding& cells) override {
+        cell_ = cells.at(cell_);
+    }
+
+    std::vector<const Position*> GetSummedCells() const override {
+        return {cell_};
+    }
+
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        if (cell_->IsValid()) {
+            cells.push_back(*cell_);
         }
     }
 
+    void CollectRanges(std::vector<CellRange>& /* ranges */) const override {
+    }
+
+    // Text cells like "inf" are converted to non-finite numbers.
+    bool IsFinite() const override {
+        return false;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
 private:
     const Position* cell_;
 };
@@ -282,8 +454,8 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+    void DoPrintFormula(std::string& out, ExprPrecedence /* precedence */) const override {
+        AppendNumber(out, value_);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -294,164 +466,1178 @@ public:
         return value_;
     }
 
-private:
-    double value_;
-};
+    std::unique_ptr<Expr> Fold() const override {
+        return nullptr;
+    }
 
-class ParseASTListener final : public FormulaBaseListener {
-public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<NumberExpr>(value_);
+    }
 
-        return root;
+    void RebindCells(const CellBinding& /* cells */) override {
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    void CollectRequiredCells(std::vector<Position>& /* cells */) const override {
     }
 
-public:
-    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-        assert(args_.size() >= 1);
+    void CollectRanges(std::vector<CellRange>& /* ranges */) const override {
+    }
 
-        auto operand = std::move(args_.back());
+    std::optional<double> GetConstant() const override {
+        return value_;
+    }
 
-        UnaryOpExpr::Type type;
-        if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
-        } else {
-            assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
-        }
+    bool IsFinite() const override {
+        return true;
+    }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
     }
 
-    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
-        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
-        }
+private:
+    double value_;
+};
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+// Keeps the #ARITHM! check of a binary operation that was folded away, e.g. A1*1 -> A1.
+// Appears in evaluation trees only.
+class CheckedExpr final : public Expr {
+public:
+    explicit CheckedExpr(std::unique_ptr<Expr> operand)
+        : operand_(std::move(operand)) {
     }
 
-    void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
+    void Print(std::ostream& out) const override {
+        operand_->Print(out);
+    }
+
+    void DoPrintFormula(std::string& out, ExprPrecedence precedence) const override {
+        operand_->DoPrintFormula(out, precedence);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return operand_->GetPrecedence();
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        double number = operand_ -> Evaluate(sheet);
+        if (!std::isfinite(number)){
+            throw FormulaError(FormulaError::Category::Arithmetic);
         }
+        return number;
+    }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+    std::unique_ptr<Expr> Fold() const override {
+        return nullptr;
     }
 
-    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-        assert(args_.size() >= 2);
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<CheckedExpr>(operand_->Clone());
+    }
 
-        auto rhs = std::move(args_.back());
-        args_.pop_back();
+    void RebindCells(const CellBinding& cells) override {
+        operand_->RebindCells(cells);
+    }
 
-        auto lhs = std::move(args_.back());
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        operand_->CollectRequiredCells(cells);
+    }
 
-        BinaryOpExpr::Type type;
-        if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
-        } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
-        } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
-        } else {
-            assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
-        }
+    void CollectRanges(std::vector<CellRange>& ranges) const override {
+        operand_->CollectRanges(ranges);
+    }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+    bool IsFinite() const override {
+        return true;
     }
 
-    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + operand_->GetMemoryUsage();
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    std::unique_ptr<Expr> operand_;
 };
 
-class BailErrorListener : public antlr4::BaseErrorListener {
+// Evaluates to 1 if the comparison holds and to 0 otherwise.
+class ComparisonExpr final : public Expr {
 public:
-    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
-                     size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
-                     std::exception_ptr /* e */
-                     ) override {
-        throw ParsingError("Error when lexing: " + msg);
+    enum Type {
+        Less,
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        Equal,
+        NotEqual,
+    };
+
+    explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(std::move(lhs))
+        , rhs_(std::move(rhs)) {
     }
-};
 
-}  // namespace
-}  // namespace ASTImpl
+    void Print(std::ostream& out) const override {
+        out << '(' << GetSign() << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
 
-FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+    void DoPrintFormula(std::string& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out += GetSign();
+        rhs_->PrintFormula(out, precedence, true);
+    }
 
-    ANTLRInputStream input(in);
+    ExprPrecedence GetPrecedence() const override {
+        return EP_CMP;
+    }
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+    double Evaluate(const SheetInterface& sheet) const override {
+        const double left_number = lhs_->Evaluate(sheet);
+        const double right_number = rhs_->Evaluate(sheet);
+        return Apply(left_number, right_number);
+    }
 
-    CommonTokenStream tokens(&lexer);
+    std::unique_ptr<Expr> Fold() const override;
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<ComparisonExpr>(type_, lhs_->Clone(), rhs_->Clone());
+    }
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    void RebindCells(const CellBinding& cells) override {
+        lhs_->RebindCells(cells);
+        rhs_->RebindCells(cells);
+    }
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        lhs_->CollectRequiredCells(cells);
+        rhs_->CollectRequiredCells(cells);
+    }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
-}
+    void CollectRanges(std::vector<CellRange>& ranges) const override {
+        lhs_->CollectRanges(ranges);
+        rhs_->CollectRanges(ranges);
+    }
 
-void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
-        out << cell.ToString() << ' ';
+    bool IsFinite() const override {
+        return true;
     }
-}
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
-}
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
-}
+private:
+    std::string_view GetSign() const {
+        switch (type_) {
+            case Less:
+                return "<";
+            case LessEqual:
+                return "<=";
+            case Greater:
+                return ">";
+            case GreaterEqual:
+                return ">=";
+            case Equal:
+                return "=";
+            default:
+                return "<>";
+        }
+    }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
-}
+    double Apply(double left_number, double right_number) const {
+        switch (type_) {
+            case Less:
+                return left_number < right_number;
+            case LessEqual:
+                return left_number <= right_number;
+            case Greater:
+                return left_number > right_number;
+            case GreaterEqual:
+                return left_number >= right_number;
+            case Equal:
+                return left_number == right_number;
+            default:
+                return left_number != right_number;
+        }
+    }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();
+    Type type_;
+    std::unique_ptr<Expr> lhs_;
+    std::unique_ptr<Expr> rhs_;
+};
+
+// IF(condition, if_true, if_false): evaluates only the branch chosen by the condition,
+// so errors and cell reads of the other branch do not matter.
+class IfExpr final : public Expr {
+public:
+    explicit IfExpr(std::unique_ptr<Expr> condition, std::unique_ptr<Expr> if_true,
+                    std::unique_ptr<Expr> if_false)
+        : condition_(std::move(condition))
+        , if_true_(std::move(if_true))
+        , if_false_(std::move(if_false)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << "(IF ";
+        condition_->Print(out);
+        out << ' ';
+        if_true_->Print(out);
+        out << ' ';
+        if_false_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(std::string& out, ExprPrecedence /* precedence */) const override {
+        out += "IF(";
+        condition_->PrintFormula(out, EP_ATOM);
+        out += ',';
+        if_true_->PrintFormula(out, EP_ATOM);
+        out += ',';
+        if_false_->PrintFormula(out, EP_ATOM);
+        out += ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        return condition_->Evaluate(sheet) != 0 ? if_true_->Evaluate(sheet) : if_false_->Evaluate(sheet);
+    }
+
+    std::unique_ptr<Expr> Fold() const override;
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<IfExpr>(condition_->Clone(), if_true_->Clone(), if_false_->Clone());
+    }
+
+    void RebindCells(const CellBinding& cells) override {
+        condition_->RebindCells(cells);
+        if_true_->RebindCells(cells);
+        if_false_->RebindCells(cells);
+    }
+
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        condition_->CollectRequiredCells(cells);
+    }
+
+    void CollectRanges(std::vector<CellRange>& ranges) const override {
+        condition_->CollectRanges(ranges);
+        if_true_->CollectRanges(ranges);
+        if_false_->CollectRanges(ranges);
+    }
+
+    bool IsFinite() const override {
+        return if_true_->IsFinite() && if_false_->IsFinite();
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + condition_->GetMemoryUsage() + if_true_->GetMemoryUsage()
+               + if_false_->GetMemoryUsage();
+    }
+
+private:
+    std::unique_ptr<Expr> condition_;
+    std::unique_ptr<Expr> if_true_;
+    std::unique_ptr<Expr> if_false_;
+};
+
+// Two corners of a cell range, e.g. A1:B10. Lookup functions read it directly,
+// it is not an expression on its own.
+class RangeRef {
+public:
+    RangeRef(const Position* first, const Position* last)
+        : first_(first)
+        , last_(last) {
+    }
+
+    void PrintFormula(std::string& out) const {
+        AppendCell(out, *first_);
+        out += ':';
+        AppendCell(out, *last_);
+    }
+
+    bool IsValid() const {
+        return first_->IsValid() && last_->IsValid();
+    }
+
+    // The range with the top left corner first; #REF! if a corner left the sheet.
+    CellRange Get() const {
+        if (!IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return {{std::min(first_->row, last_->row), std::min(first_->col, last_->col)},
+                {std::max(first_->row, last_->row), std::max(first_->col, last_->col)}};
+    }
+
+    void RebindCells(const CellBinding& cells) {
+        first_ = cells.at(first_);
+        last_ = cells.at(last_);
+    }
+
+private:
+    const Position* first_;
+    const Position* last_;
+};
+
+// VLOOKUP(value, range, column[, approximate]), MATCH(value, range[, type]) and
+// INDEX(range, row[, column]). Positions are 1-based. Lookups go through the
+// column index of the sheet: a hash for exact matches and a sorted array for
+// approximate ones, which find the largest value not greater than the key
+// (MATCH type -1: the smallest value not less than the key).
+class LookupExpr final : public Expr {
+public:
+    enum Type {
+        VLookup,
+        Match,
+        Index,
+    };
+
+    explicit LookupExpr(Type type, RangeRef range, std::vector<std::unique_ptr<Expr>> args)
+        : type_(type)
+        , range_(range)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << GetName();
+        for (size_t i = 0; i <= args_.size(); ++i) {
+            out << ' ';
+            if (i == GetRangeArgument()) {
+                std::string range;
+                range_.PrintFormula(range);
+                out << range;
+            } else {
+                args_[i < GetRangeArgument() ? i : i - 1]->Print(out);
+            }
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::string& out, ExprPrecedence /* precedence */) const override {
+        out += GetName();
+        out += '(';
+        for (size_t i = 0; i <= args_.size(); ++i) {
+            if (i > 0) {
+                out += ',';
+            }
+            if (i == GetRangeArgument()) {
+                range_.PrintFormula(out);
+            } else {
+                args_[i < GetRangeArgument() ? i : i - 1]->PrintFormula(out, EP_ATOM);
+            }
+        }
+        out += ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    // Arguments are evaluated left to right, so the leftmost error wins.
+    double Evaluate(const SheetInterface& sheet) const override {
+        switch (type_) {
+            case VLookup: {
+                const double value = args_[0]->Evaluate(sheet);
+                const CellRange range = range_.Get();
+                const int col = ToOffset(args_[1]->Evaluate(sheet), range.last.col - range.first.col + 1);
+                const bool approximate = args_.size() < 3 || args_[2]->Evaluate(sheet) != 0;
+                const int row = FindRow(sheet, range, value, approximate ? 1 : 0);
+                return GetCellNumber(sheet, {range.first.row + row, range.first.col + col});
+            }
+            case Match: {
+                const double value = args_[0]->Evaluate(sheet);
+                const CellRange range = range_.Get();
+                const double match_type = args_.size() < 2 ? 1 : args_[1]->Evaluate(sheet);
+                if (range.first.col != range.last.col) {
+                    throw FormulaError(FormulaError::Category::Value);
+                }
+                return FindRow(sheet, range, value, match_type > 0 ? 1 : match_type < 0 ? -1 : 0) + 1;
+            }
+            default: {
+                const CellRange range = range_.Get();
+                const int row = ToOffset(args_[0]->Evaluate(sheet), range.last.row - range.first.row + 1);
+                const int col = args_.size() < 2
+                    ? 0 : ToOffset(args_[1]->Evaluate(sheet), range.last.col - range.first.col + 1);
+                return GetCellNumber(sheet, {range.first.row + row, range.first.col + col});
+            }
+        }
+    }
+
+    std::unique_ptr<Expr> Fold() const override;
+
+    std::unique_ptr<Expr> Clone() const override {
+        std::vector<std::unique_ptr<Expr>> args;
+        for (const auto& arg : args_) {
+            args.push_back(arg->Clone());
+        }
+        return std::make_unique<LookupExpr>(type_, range_, std::move(args));
+    }
+
+    void RebindCells(const CellBinding& cells) override {
+        range_.RebindCells(cells);
+        for (const auto& arg : args_) {
+            arg->RebindCells(cells);
+        }
+    }
+
+    // Cells of the range are read on demand while the column index is built.
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        for (const auto& arg : args_) {
+            arg->CollectRequiredCells(cells);
+        }
+    }
+
+    void CollectRanges(std::vector<CellRange>& ranges) const override {
+        if (range_.IsValid()) {
+            ranges.push_back(range_.Get());
+        }
+        for (const auto& arg : args_) {
+            arg->CollectRanges(ranges);
+        }
+    }
+
+    // Found cells may hold text like "inf".
+    bool IsFinite() const override {
+        return false;
+    }
+
+    size_t GetMemoryUsage() const override {
+        size_t result = sizeof(*this) + args_.capacity() * sizeof(args_.front());
+        for (const auto& arg : args_) {
+            result += arg->GetMemoryUsage();
+        }
+        return result;
+    }
+
+private:
+    std::string_view GetName() const {
+        switch (type_) {
+            case VLookup:
+                return "VLOOKUP";
+            case Match:
+                return "MATCH";
+            default:
+                return "INDEX";
+        }
+    }
+
+    // Place of the range among the arguments as written.
+    size_t GetRangeArgument() const {
+        return type_ == Index ? 0 : 1;
+    }
+
+    // 0-based offset from a 1-based position argument, truncated like in other spreadsheets.
+    static int ToOffset(double position, int size) {
+        if (!(position >= 1)) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if (position >= size + 1.0) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return static_cast<int>(position) - 1;
+    }
+
+    // Offset of the row of the first column of range where value is found; #N/A if none.
+    static int FindRow(const SheetInterface& sheet, CellRange range, double value, int match_type) {
+        const ColumnIndex* index = sheet.GetColumnIndex(range.first.col, range.first.row, range.last.row);
+        std::optional<ColumnIndex> own_index;
+        if (!index) {
+            index = &own_index.emplace(sheet, range.first.col, range.first.row, range.last.row);
+        }
+        const std::optional<int> row = match_type == 0 ? index->FindEqual(value)
+            : match_type > 0 ? index->FindLessOrEqual(value)
+            : index->FindGreaterOrEqual(value);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        return *row;
+    }
+
+    Type type_;
+    RangeRef range_;
+    std::vector<std::unique_ptr<Expr>> args_;
+};
+
+// Operands of specialized evaluators, read exactly like CellExpr and NumberExpr.
+class CellOperand {
+public:
+    explicit CellOperand(const Position* cell)
+        : cell_(cell) {
+    }
+
+    double Evaluate(const SheetInterface& sheet) const {
+        if (!cell_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return GetCellNumber(sheet, *cell_);
+    }
+
+    void PrintFormula(std::string& out) const {
+        AppendCell(out, *cell_);
+    }
+
+    void RebindCells(const CellBinding& cells) {
+        cell_ = cells.at(cell_);
+    }
+
+    void CollectRequiredCells(std::vector<Position>& cells) const {
+        if (cell_->IsValid()) {
+            cells.push_back(*cell_);
+        }
+    }
+
+    const Position* GetCell() const {
+        return cell_;
+    }
+
+private:
+    const Position* cell_;
+};
+
+class ConstOperand {
+public:
+    explicit ConstOperand(double value)
+        : value_(value) {
+    }
+
+    double Evaluate(const SheetInterface& /* sheet */) const {
+        return value_;
+    }
+
+    void PrintFormula(std::string& out) const {
+        AppendNumber(out, value_);
+    }
+
+    void RebindCells(const CellBinding& /* cells */) {
+    }
+
+    void CollectRequiredCells(std::vector<Position>& /* cells */) const {
+    }
+
+private:
+    double value_;
+};
+
+// BinaryOpExpr with the operation and the kinds of both operands fixed at compile time,
+// e.g. A1*B1 or A1/2: no virtual calls for the operands and no switch on the operation.
+// Operands are read and the result is checked in the same order as in BinaryOpExpr.
+// Appears in evaluation trees only.
+template <BinaryOpExpr::Type type, typename Lhs, typename Rhs>
+class SpecializedBinaryOpExpr final : public Expr {
+public:
+    SpecializedBinaryOpExpr(Lhs lhs, Rhs rhs)
+        : lhs_(lhs)
+        , rhs_(rhs) {
+    }
+
+    void Print(std::ostream& out) const override {
+        std::string lhs;
+        lhs_.PrintFormula(lhs);
+        std::string rhs;
+        rhs_.PrintFormula(rhs);
+        out << '(' << static_cast<char>(type) << ' ' << lhs << ' ' << rhs << ')';
+    }
+
+    void DoPrintFormula(std::string& out, ExprPrecedence /* precedence */) const override {
+        lhs_.PrintFormula(out);
+        out += static_cast<char>(type);
+        rhs_.PrintFormula(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return type == BinaryOpExpr::Add        ? EP_ADD
+               : type == BinaryOpExpr::Subtract ? EP_SUB
+               : type == BinaryOpExpr::Multiply ? EP_MUL
+                                                : EP_DIV;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        const double left_number = lhs_.Evaluate(sheet);
+        const double right_number = rhs_.Evaluate(sheet);
+        double number;
+        if constexpr (type == BinaryOpExpr::Add) {
+            number = left_number + right_number;
+        } else if constexpr (type == BinaryOpExpr::Subtract) {
+            number = left_number - right_number;
+        } else if constexpr (type == BinaryOpExpr::Multiply) {
+            number = left_number * right_number;
+        } else {
+            number = left_number / right_number;
+        }
+
+        if (!std::isfinite(number)) {
+            throw FormulaError(FormulaError::Category::Arithmetic);
+        }
+        return number;
+    }
+
+    std::unique_ptr<Expr> Fold() const override {
+        return nullptr;
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<SpecializedBinaryOpExpr>(lhs_, rhs_);
+    }
+
+    void RebindCells(const CellBinding& cells) override {
+        lhs_.RebindCells(cells);
+        rhs_.RebindCells(cells);
+    }
+
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        lhs_.CollectRequiredCells(cells);
+        rhs_.CollectRequiredCells(cells);
+    }
+
+    void CollectRanges(std::vector<CellRange>& /* ranges */) const override {
+    }
+
+    bool IsFinite() const override {
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+private:
+    Lhs lhs_;
+    Rhs rhs_;
+};
+
+// A1+A2+...+An as a loop. Like the tree of additions it replaces, it reads the cells
+// left to right and checks every partial sum for #ARITHM! before reading the next cell.
+// Appears in evaluation trees only.
+class CellSumExpr final : public Expr {
+public:
+    explicit CellSumExpr(std::vector<CellOperand> cells)
+        : cells_(std::move(cells)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        std::string text;
+        DoPrintFormula(text, EP_ADD);
+        out << "(+ " << text << ')';
+    }
+
+    void DoPrintFormula(std::string& out, ExprPrecedence /* precedence */) const override {
+        for (size_t i = 0; i < cells_.size(); ++i) {
+            if (i > 0) {
+                out += '+';
+            }
+            cells_[i].PrintFormula(out);
+        }
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ADD;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        double sum = cells_.front().Evaluate(sheet);
+        for (size_t i = 1; i < cells_.size(); ++i) {
+            sum += cells_[i].Evaluate(sheet);
+            if (!std::isfinite(sum)) {
+                throw FormulaError(FormulaError::Category::Arithmetic);
+            }
+        }
+        return sum;
+    }
+
+    std::unique_ptr<Expr> Fold() const override {
+        return nullptr;
+    }
+
+    std::unique_ptr<Expr> Clone() const override {
+        return std::make_unique<CellSumExpr>(cells_);
+    }
+
+    void RebindCells(const CellBinding& cells) override {
+        for (auto& cell : cells_) {
+            cell.RebindCells(cells);
+        }
+    }
+
+    void CollectRequiredCells(std::vector<Position>& cells) const override {
+        for (const auto& cell : cells_) {
+            cell.CollectRequiredCells(cells);
+        }
+    }
+
+    void CollectRanges(std::vector<CellRange>& /* ranges */) const override {
+    }
+
+    std::vector<const Position*> GetSummedCells() const override {
+        std::vector<const Position*> cells;
+        cells.reserve(cells_.size());
+        for (const auto& cell : cells_) {
+            cells.push_back(cell.GetCell());
+        }
+        return cells;
+    }
+
+    bool IsFinite() const override {
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + cells_.capacity() * sizeof(CellOperand);
+    }
+
+private:
+    std::vector<CellOperand> cells_;
+};
+
+template <typename Lhs, typename Rhs>
+std::unique_ptr<Expr> MakeSpecializedBinaryOp(BinaryOpExpr::Type type, Lhs lhs, Rhs rhs) {
+    switch (type) {
+        case BinaryOpExpr::Add:
+            return std::make_unique<SpecializedBinaryOpExpr<BinaryOpExpr::Add, Lhs, Rhs>>(lhs, rhs);
+        case BinaryOpExpr::Subtract:
+            return std::make_unique<SpecializedBinaryOpExpr<BinaryOpExpr::Subtract, Lhs, Rhs>>(lhs, rhs);
+        case BinaryOpExpr::Multiply:
+            return std::make_unique<SpecializedBinaryOpExpr<BinaryOpExpr::Multiply, Lhs, Rhs>>(lhs, rhs);
+        default:
+            return std::make_unique<SpecializedBinaryOpExpr<BinaryOpExpr::Divide, Lhs, Rhs>>(lhs, rhs);
+    }
+}
+
+// An evaluator for the common shapes cell op cell, cell op constant, constant op cell
+// and A1+A2+...+An, built from already folded operands; nullptr for other shapes.
+std::unique_ptr<Expr> Specialize(BinaryOpExpr::Type type, const Expr& lhs, const Expr& rhs) {
+    const auto left_cells = lhs.GetSummedCells();
+    const auto right_cells = rhs.GetSummedCells();
+    const auto left_value = lhs.GetConstant();
+    const auto right_value = rhs.GetConstant();
+
+    // Only a left-leaning chain is a loop: A1+(A2+A3) checks A2+A3 first
+    if (type == BinaryOpExpr::Add && !left_cells.empty() && right_cells.size() == 1) {
+        std::vector<CellOperand> cells(left_cells.begin(), left_cells.end());
+        cells.emplace_back(right_cells.front());
+        return std::make_unique<CellSumExpr>(std::move(cells));
+    }
+    if (left_cells.size() == 1 && right_cells.size() == 1) {
+        return MakeSpecializedBinaryOp(type, CellOperand(left_cells.front()), CellOperand(right_cells.front()));
+    }
+    if (left_cells.size() == 1 && right_value) {
+        return MakeSpecializedBinaryOp(type, CellOperand(left_cells.front()), ConstOperand(*right_value));
+    }
+    if (left_value && right_cells.size() == 1) {
+        return MakeSpecializedBinaryOp(type, ConstOperand(*left_value), CellOperand(right_cells.front()));
+    }
+    return nullptr;
+}
+
+std::unique_ptr<Expr> TakeFolded(std::unique_ptr<Expr> folded, const std::unique_ptr<Expr>& original) {
+    return folded ? std::move(folded) : original->Clone();
+}
+
+std::unique_ptr<Expr> BinaryOpExpr::Fold() const {
+    auto lhs = lhs_->Fold();
+    auto rhs = rhs_->Fold();
+    const auto left_value = (lhs ? *lhs : *lhs_).GetConstant();
+    const auto right_value = (rhs ? *rhs : *rhs_).GetConstant();
+
+    if (left_value && right_value) {
+        // Constant subtrees that overflow are left as is to raise #ARITHM! at evaluation.
+        const double number = Apply(*left_value, *right_value);
+        if (std::isfinite(number)) {
+            return std::make_unique<NumberExpr>(number);
+        }
+    }
+
+    std::unique_ptr<Expr> kept;
+    if (IsIdentity(right_value, true)) {
+        kept = TakeFolded(std::move(lhs), lhs_);
+    } else if (IsIdentity(left_value, false)) {
+        kept = TakeFolded(std::move(rhs), rhs_);
+    }
+    if (kept) {
+        return kept->IsFinite() ? std::move(kept) : std::make_unique<CheckedExpr>(std::move(kept));
+    }
+
+    if (auto specialized = Specialize(type_, lhs ? *lhs : *lhs_, rhs ? *rhs : *rhs_)) {
+        return specialized;
+    }
+    if (!lhs && !rhs) {
+        return nullptr;
+    }
+    return std::make_unique<BinaryOpExpr>(type_, TakeFolded(std::move(lhs), lhs_),
+                                          TakeFolded(std::move(rhs), rhs_));
+}
+
+std::unique_ptr<Expr> UnaryOpExpr::Fold() const {
+    auto operand = operand_->Fold();
+    if (const auto value = (operand ? *operand : *operand_).GetConstant()) {
+        return std::make_unique<NumberExpr>(type_ == UnaryMinus ? -*value : *value);
+    }
+    if (type_ == UnaryPlus) {
+        return TakeFolded(std::move(operand), operand_);
+    }
+    if (!operand) {
+        return nullptr;
+    }
+    return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+}
+
+std::unique_ptr<Expr> ComparisonExpr::Fold() const {
+    auto lhs = lhs_->Fold();
+    auto rhs = rhs_->Fold();
+    const auto left_value = (lhs ? *lhs : *lhs_).GetConstant();
+    const auto right_value = (rhs ? *rhs : *rhs_).GetConstant();
+    if (left_value && right_value) {
+        return std::make_unique<NumberExpr>(Apply(*left_value, *right_value));
+    }
+    if (!lhs && !rhs) {
+        return nullptr;
+    }
+    return std::make_unique<ComparisonExpr>(type_, TakeFolded(std::move(lhs), lhs_),
+                                            TakeFolded(std::move(rhs), rhs_));
+}
+
+std::unique_ptr<Expr> IfExpr::Fold() const {
+    auto condition = condition_->Fold();
+    auto if_true = if_true_->Fold();
+    auto if_false = if_false_->Fold();
+    if (const auto value = (condition ? *condition : *condition_).GetConstant()) {
+        return *value != 0 ? TakeFolded(std::move(if_true), if_true_)
+                           : TakeFolded(std::move(if_false), if_false_);
+    }
+    if (!condition && !if_true && !if_false) {
+        return nullptr;
+    }
+    return std::make_unique<IfExpr>(TakeFolded(std::move(condition), condition_),
+                                    TakeFolded(std::move(if_true), if_true_),
+                                    TakeFolded(std::move(if_false), if_false_));
+}
+
+std::unique_ptr<Expr> LookupExpr::Fold() const {
+    std::vector<std::unique_ptr<Expr>> folded;
+    bool changed = false;
+    for (const auto& arg : args_) {
+        folded.push_back(arg->Fold());
+        changed = changed || folded.back();
+    }
+    if (!changed) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < args_.size(); ++i) {
+        folded[i] = TakeFolded(std::move(folded[i]), args_[i]);
+    }
+    return std::make_unique<LookupExpr>(type_, range_, std::move(folded));
+}
+
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    std::unique_ptr<Expr> MoveRoot() {
+        assert(args_.size() == 1);
+        auto root = std::move(args_.front());
+        args_.clear();
+
+        return root;
+    }
+
+    std::forward_list<Position> MoveCells() {
+        return std::move(cells_);
+    }
+
+public:
+    void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
+        assert(args_.size() >= 1);
+
+        auto operand = std::move(args_.back());
+
+        UnaryOpExpr::Type type;
+        if (ctx->SUB()) {
+            type = UnaryOpExpr::UnaryMinus;
+        } else {
+            assert(ctx->ADD() != nullptr);
+            type = UnaryOpExpr::UnaryPlus;
+        }
+
+        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        args_.back() = std::move(node);
+    }
+
+    void exitLiteral(FormulaParser::LiteralContext* ctx) override {
+        double value = 0;
+        auto valueStr = ctx->NUMBER()->getSymbol()->getText();
+        std::istringstream in(valueStr);
+        in >> value;
+        if (!in) {
+            throw ParsingError("Invalid number: " + valueStr);
+        }
+
+        auto node = std::make_unique<NumberExpr>(value);
+        args_.push_back(std::move(node));
+    }
+
+    void exitCell(FormulaParser::CellContext* ctx) override {
+        auto node = std::make_unique<CellExpr>(AddCell(ctx->CELL()));
+        args_.push_back(std::move(node));
+    }
+
+    void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+
+        BinaryOpExpr::Type type;
+        if (ctx->ADD()) {
+            type = BinaryOpExpr::Add;
+        } else if (ctx->SUB()) {
+            type = BinaryOpExpr::Subtract;
+        } else if (ctx->MUL()) {
+            type = BinaryOpExpr::Multiply;
+        } else {
+            assert(ctx->DIV() != nullptr);
+            type = BinaryOpExpr::Divide;
+        }
+
+        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        args_.back() = std::move(node);
+    }
+
+    void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = std::move(args_.back());
+        args_.pop_back();
+
+        auto lhs = std::move(args_.back());
+
+        ComparisonExpr::Type type;
+        if (ctx->LT()) {
+            type = ComparisonExpr::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonExpr::LessEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonExpr::Greater;
+        } else if (ctx->GE()) {
+            type = ComparisonExpr::GreaterEqual;
+        } else if (ctx->EQ()) {
+            type = ComparisonExpr::Equal;
+        } else {
+            assert(ctx->NE() != nullptr);
+            type = ComparisonExpr::NotEqual;
+        }
+
+        auto node = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+        args_.back() = std::move(node);
+    }
+
+    void exitIf(FormulaParser::IfContext* /* ctx */) override {
+        assert(args_.size() >= 3);
+
+        auto if_false = std::move(args_.back());
+        args_.pop_back();
+        auto if_true = std::move(args_.back());
+        args_.pop_back();
+
+        auto condition = std::move(args_.back());
+
+        auto node = std::make_unique<IfExpr>(std::move(condition), std::move(if_true), std::move(if_false));
+        args_.back() = std::move(node);
+    }
+
+    void exitVLookup(FormulaParser::VLookupContext* ctx) override {
+        AddLookup(LookupExpr::VLookup, ctx->CELL(0), ctx->CELL(1), ctx->expr().size());
+    }
+
+    void exitMatch(FormulaParser::MatchContext* ctx) override {
+        AddLookup(LookupExpr::Match, ctx->CELL(0), ctx->CELL(1), ctx->expr().size());
+    }
+
+    void exitIndex(FormulaParser::IndexContext* ctx) override {
+        AddLookup(LookupExpr::Index, ctx->CELL(0), ctx->CELL(1), ctx->expr().size());
+    }
+
+    void visitErrorNode(antlr4::tree::ErrorNode* node) override {
+        throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    }
+
+private:
+    const Position* AddCell(antlr4::tree::TerminalNode* cell) {
+        auto value_str = cell->getSymbol()->getText();
+        auto value = Position::FromString(value_str);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + value_str);
+        }
+
+        cells_.push_front(value);
+        return &cells_.front();
+    }
+
+    // Replaces the last arg_count arguments with a lookup over first:last.
+    void AddLookup(LookupExpr::Type type, antlr4::tree::TerminalNode* first,
+                   antlr4::tree::TerminalNode* last, size_t arg_count) {
+        assert(args_.size() >= arg_count);
+
+        const Position* first_cell = AddCell(first);
+        const Position* last_cell = AddCell(last);
+        std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - arg_count),
+                                                std::make_move_iterator(args_.end()));
+        args_.resize(args_.size() - arg_count);
+
+        auto node = std::make_unique<LookupExpr>(type, RangeRef(first_cell, last_cell), std::move(args));
+        args_.push_back(std::move(node));
+    }
+
+    std::vector<std::unique_ptr<Expr>> args_;
+    std::forward_list<Position> cells_;
+};
+
+class BailErrorListener : public antlr4::BaseErrorListener {
+public:
+    void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
+                     size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
+                     std::exception_ptr /* e */
+                     ) override {
+        throw ParsingError("Error when lexing: " + msg);
+    }
+};
+
+// Owns the whole ANTLR pipeline. Every Parse rewinds the input, the lexer,
+// the token buffer and the parser instead of building them anew; the ATN and
+// DFA caches are static in the generated code and stay warm between calls.
+// A parse that bailed out leaves no state behind: the next Parse resets all.
+class ParserContext {
+public:
+    ParserContext()
+        : lexer_(&input_)
+        , tokens_(&lexer_)
+        , parser_(&tokens_) {
+        lexer_.removeErrorListeners();
+        lexer_.addErrorListener(&error_listener_);
+        parser_.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+        parser_.removeErrorListeners();
+    }
+
+    ParserContext(const ParserContext&) = delete;
+    ParserContext& operator=(const ParserContext&) = delete;
+
+    FormulaAST Parse(std::string_view text) {
+        input_.load(text.data(), text.size(), false);
+        lexer_.setInputStream(&input_);
+        tokens_.setTokenSource(&lexer_);
+        parser_.setTokenStream(&tokens_);
+
+        antlr4::tree::ParseTree* tree = parser_.main();
+        ParseASTListener listener;
+        antlr4::tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+
+        return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    }
+
+private:
+    BailErrorListener error_listener_;
+    antlr4::ANTLRInputStream input_;
+    FormulaLexer lexer_;
+    antlr4::CommonTokenStream tokens_;
+    FormulaParser parser_;
+};
+
+}  // namespace
+}  // namespace ASTImpl
+
+FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaAST(std::string_view(text));
+}
+
+FormulaAST ParseFormulaAST(std::string_view in_str) {
+    thread_local ASTImpl::ParserContext context;
+    return context.Parse(in_str);
+}
+
+void FormulaAST::PrintCells(std::ostream& out) const {
+    for (auto cell : cells_) {
+        out << cell.ToString() << ' ';
+    }
+}
+
+void FormulaAST::Print(std::ostream& out) const {
+    root_expr_->Print(out);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out) const {
+    out << expression_;
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    // A forward_list node keeps a pointer to the next node and the value
+    const size_t cells_size = std::distance(cells_.begin(), cells_.end())
+                              * (sizeof(void*) + sizeof(Position));
+    return root_expr_->GetMemoryUsage() + (eval_expr_ ? eval_expr_->GetMemoryUsage() : 0)
+           + cells_size + required_cells_.capacity() * sizeof(Position)
+           + ranges_.capacity() * sizeof(CellRange) + expression_.capacity() + source_.capacity();
+}
+
+void FormulaAST::SetSource(std::string source) {
+    if (source == expression_) {
+        source_.clear();
+    } else {
+        source_ = std::move(source);
+    }
+}
+
+double FormulaAST::Execute(const SheetInterface& sheet) const {
+    return (eval_expr_ ? eval_expr_ : root_expr_)->Evaluate(sheet);
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+    : root_expr_(std::move(root_expr))
+    , eval_expr_(root_expr_->Fold())
+    , cells_(std::move(cells)) {
+    cells_.sort();
+
+    // Folding may drop a branch, so the cells are taken from the tree Execute runs.
+    (eval_expr_ ? eval_expr_ : root_expr_)->CollectRequiredCells(required_cells_);
+    std::sort(required_cells_.begin(), required_cells_.end());
+    required_cells_.erase(std::unique(required_cells_.begin(), required_cells_.end()),
+                          required_cells_.end());
+    size_t referenced = 0;
+    const Position* previous = nullptr;
+    for (const Position& cell : cells_) {
+        if (cell.IsValid() && !(previous && *previous == cell)) {
+            ++referenced;
+        }
+        previous = &cell;
+    }
+    has_conditional_cells_ = required_cells_.size() != referenced;
+    if (!has_conditional_cells_) {
+        required_cells_ = {};
+    }
+    root_expr_->CollectRanges(ranges_);
+    ranges_.shrink_to_fit();
+
+    root_expr_->PrintFormula(expression_, ASTImpl::EP_ATOM);
+    expression_.shrink_to_fit();
+}
+
+FormulaAST FormulaAST::Shift(int row_shift, int col_shift) const {
+    std::forward_list<Position> cells;
+    ASTImpl::CellBinding binding;
+    auto tail = cells.before_begin();
+    for (const Position& cell : cells_) {
+        // #REF! stays #REF!: shifting Position::NONE back could land on a real cell
+        const Position shifted{cell.row + row_shift, cell.col + col_shift};
+        tail = cells.insert_after(tail, cell.IsValid() && shifted.IsValid() ? shifted : Position::NONE);
+        binding[&cell] = &*tail;
+    }
+    auto root_expr = root_expr_->Clone();
+    root_expr->RebindCells(binding);
+    return FormulaAST(std::move(root_expr), std::move(cells));
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
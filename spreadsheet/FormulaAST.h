@@ -6,6 +6,8 @@
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
@@ -19,8 +21,8 @@ class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
                         std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
     double Execute(const SheetInterface& sheet) const;
@@ -28,6 +30,26 @@ public:
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
+    // Canonical text of the formula, printed once when the AST is built
+    const std::string& GetExpression() const {
+        return expression_;
+    }
+
+    // Text the AST was parsed from, as remembered by SetSource;
+    // the canonical text if nothing else was remembered
+    const std::string& GetSource() const {
+        return source_.empty() ? expression_ : source_;
+    }
+
+    void SetSource(std::string source);
+
+    // Heap memory owned by the AST, in bytes
+    size_t GetMemoryUsage() const;
+
+    // Copy of the AST with every cell reference moved by the given offsets,
+    // without reparsing. References that leave the sheet become #REF!.
+    FormulaAST Shift(int row_shift, int col_shift) const;
+
     std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -36,11 +58,38 @@ public:
         return cells_;
     }
 
+    // Whether some cells are referenced only inside IF branches or lookup ranges
+    // and are not read by every evaluation.
+    bool HasConditionalCells() const {
+        return has_conditional_cells_;
+    }
+
+    // Sorted valid cells read by every evaluation of the folded tree; filled only if
+    // HasConditionalCells().
+    const std::vector<Position>& GetRequiredCells() const {
+        return required_cells_;
+    }
+
+    // Valid ranges of lookup functions. The formula depends on every cell of them.
+    const std::vector<CellRange>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // Folded copy of root_expr_ used by Execute; nullptr if folding changed nothing.
+    // root_expr_ is kept untouched for printing.
+    std::unique_ptr<ASTImpl::Expr> eval_expr_;
 
     std::forward_list<Position> cells_;
+    bool has_conditional_cells_ = false;
+    std::vector<Position> required_cells_;
+    std::vector<CellRange> ranges_;
+    std::string expression_;
+    // Empty when it would repeat expression_
+    std::string source_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// Parses with a lexer and parser kept per thread and rewound between calls
+FormulaAST ParseFormulaAST(std::string_view in_str);
@@ -1,129 +1,325 @@
 #include "cell.h"
 #include "sheet.h"
 
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+
 using namespace std::literals;
 
+namespace {
+    // Значение формулы в 64 битах: число хранится как есть, а ошибка и
+    // отсутствие значения - как NaN с особым старшим словом. Ссылка вроде
+    // =A1 передаёт NaN из ячейки как есть, поэтому любой NaN перед упаковкой
+    // заменяется одним тихим NaN, который с этими метками не совпадает
+    constexpr std::uint64_t TAG_MASK = 0xffff'0000'0000'0000;
+    constexpr std::uint64_t NO_VALUE = 0x7ff4'0000'0000'0000;
+    constexpr std::uint64_t ERROR_TAG = 0x7ff5'0000'0000'0000;
+    constexpr std::uint64_t CANONICAL_NAN = 0x7ff8'0000'0000'0000;
+
+    std::uint64_t PackValue(const FormulaInterface::Value& value){
+        if (const double* number = std::get_if<double>(&value)){
+            if (std::isnan(*number)){
+                return CANONICAL_NAN;
+            }
+            std::uint64_t bits;
+            std::memcpy(&bits, number, sizeof(bits));
+            return bits;
+        }
+        return ERROR_TAG | static_cast<std::uint64_t>(std::get<FormulaError>(value).GetCategory());
+    }
+
+    std::optional<CellInterface::Value> UnpackValue(std::uint64_t bits){
+        if (bits == NO_VALUE){
+            return std::nullopt;
+        }
+        if ((bits & TAG_MASK) == ERROR_TAG){
+            return FormulaError(static_cast<FormulaError::Category>(bits & ~TAG_MASK));
+        }
+        double number;
+        std::memcpy(&number, &bits, sizeof(number));
+        return number;
+    }
+
+    // Столько формул может вычисляться одна внутри другой, прежде чем
+    // вычисление вернётся к явному стеку
+    constexpr size_t MAX_NESTED_EVALUATIONS = 64;
+
+    // Формулы, которые сейчас вычисляет этот поток, от внешней к внутренней
+    thread_local std::vector<const FormulaImpl*> evaluating;
+
+    // Вложенных вычислений стало слишком много, а понадобилось значение
+    // устаревшей формулы formula. path - прерванные вычисления
+    struct StaleReference {
+        const FormulaImpl* formula;
+        std::vector<const FormulaImpl*> path;
+    };
+
+    // Отмечает формулу вычисляемой на время своей жизни
+    class EvaluatingScope {
+    public:
+        explicit EvaluatingScope(const FormulaImpl* formula){
+            evaluating.push_back(formula);
+        }
+
+        ~EvaluatingScope(){
+            evaluating.pop_back();
+        }
+
+        EvaluatingScope(const EvaluatingScope&) = delete;
+        EvaluatingScope& operator=(const EvaluatingScope&) = delete;
+    };
+}
+
 // class Cell
 
 CellInterface::Value Cell::GetValue() const {
-    if (value_.has_value()){
-        return value_.value();
+    if (const auto* text = std::get_if<std::string>(&content_)){
+        if ((*text)[0] == ESCAPE_SIGN){
+            return text -> substr(1);
+        }
+        return *text;
     }
-    const CellInterface::Value value = impl_ -> GetValue();
-    if (std::holds_alternative<double>(value)){
-        value_ = std::get<double>(value);
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaImpl>>(&content_)){
+        return (*formula) -> GetValue();
     }
-    return value;
+    if (const auto* input = GetInput()){
+        return *input;
+    }
+    return {};
 }
 
-void Cell::CheckCircularDependency(const std::vector<Position>& reff_cells){
-    for (auto pos : reff_cells){
-        if (pos == current_pos_){
-            throw CircularDependencyException{"Wrong formula with circular"s};
-        }
-        const auto cell = sheet_ -> GetCell(pos);
-        CheckCircularDependency(cell ? cell -> GetReferencedCells() : std::vector<Position>{});
+std::string Cell::GetText() const {
+    if (const auto* text = std::get_if<std::string>(&content_)){
+        return *text;
+    }
+    if (const auto* formula = std::get_if<std::unique_ptr<FormulaImpl>>(&content_)){
+        return (*formula) -> GetText();
     }
+    if (const auto* input = GetInput()){
+        // Кратчайшая запись, по которой ParseCellNumber вернёт то же число
+        char buffer[32];
+        return std::string(buffer, std::to_chars(std::begin(buffer), std::end(buffer), *input).ptr);
+    }
+    return {};
 }
 
-Position& Cell::GetPos(){
-    return current_pos_;
+std::vector<Position> Cell::GetReferencedCells() const {
+    const auto* formula = GetFormula();
+    return formula ? formula -> GetReferencedCells() : std::vector<Position>{};
 }
 
-const Position& Cell::GetPos() const {
-    return current_pos_;
+std::vector<CellRange> Cell::GetReferencedRanges() const {
+    const auto* formula = GetFormula();
+    return formula ? formula -> GetReferencedRanges() : std::vector<CellRange>{};
 }
 
-void Cell::SetPos(Position pos){
-    current_pos_ = pos;
+bool Cell::HasText(std::string_view text) const {
+    if (const auto* content = std::get_if<std::string>(&content_)){
+        return *content == text;
+    }
+    if (const auto* formula = GetFormula()){
+        return formula -> HasText(text);
+    }
+    // Текст никогда не задаёт входное число
+    return IsEmpty() && text.empty();
 }
 
-std::string Cell::GetText() const {
-    return impl_ -> GetText();
+bool Cell::IsEmpty() const {
+    return std::holds_alternative<std::monostate>(content_);
 }
 
-std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_ -> GetReferencedCells();
+std::string_view Cell::GetTextValue() const {
+    const auto* text = std::get_if<std::string>(&content_);
+    if (!text){
+        return {};
+    }
+    std::string_view value = *text;
+    if (value[0] == ESCAPE_SIGN){
+        value.remove_prefix(1);
+    }
+    return value;
 }
 
-const std::unique_ptr<Impl>& Cell::GetImpl() const {
-    return impl_;
+const double* Cell::GetInput() const {
+    return std::get_if<double>(&content_);
 }
 
-std::unique_ptr<Impl>& Cell::GetImpl(){
-    return impl_;
+const FormulaImpl* Cell::GetFormula() const {
+    const auto* formula = std::get_if<std::unique_ptr<FormulaImpl>>(&content_);
+    return formula ? formula -> get() : nullptr;
 }
 
-void Cell::Set(std::string text){
-    const std::vector<Position> old_ref_pos = impl_ ? GetReferencedCells() : std::vector<Position>();
-    if (text[0] == FORMULA_SIGN && text.size() > 1){
-        std::unique_ptr<Impl> temp = std::make_unique<FormulaImpl>(text.substr(1), *sheet_);
-        CheckCircularDependency(temp -> GetReferencedCells());
-        impl_ = std::move(temp);
-    } else if (!text.empty()){
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+void Cell::SetText(std::string text){
+    if (text.empty()){
+        content_ = std::monostate{};
     } else {
-        impl_ = std::make_unique<EmptyImpl>();
+        content_ = std::move(text);
     }
-    ResetCache();
-    sheet_ -> InvalidCachePos(current_pos_);
+}
 
-    sheet_ -> RemoveOldDependedCells(current_pos_, old_ref_pos);
-    sheet_ -> AddNewDependedCells(current_pos_, impl_ -> GetReferencedCells());
+void Cell::SetFormula(std::unique_ptr<FormulaImpl> formula){
+    content_ = std::move(formula);
 }
 
-void Cell::Clear(){
-    value_.reset();
-    sheet_ -> InvalidCachePos(current_pos_);
-    sheet_ -> RemoveOldDependedCells(current_pos_, impl_ -> GetReferencedCells());
-    impl_.reset();
+void Cell::SetInput(double value){
+    content_ = value;
 }
 
 void Cell::ResetCache(){
-    value_.reset();
+    if (auto* formula = std::get_if<std::unique_ptr<FormulaImpl>>(&content_)){
+        (*formula) -> ResetCache();
+    }
 }
 
-// class Impl;
-
-CellInterface::Value EmptyImpl::GetValue() const {
-    return {};
+size_t Cell::GetHeapUsage() const {
+    if (const auto* text = std::get_if<std::string>(&content_)){
+        // Короткая строка хранится внутри объекта std::string
+        const char* data = text -> data();
+        const char* object = reinterpret_cast<const char*>(text);
+        const bool is_inline = object <= data && data < object + sizeof(std::string);
+        return is_inline ? 0 : text -> capacity() + 1;
+    }
+    if (const auto* formula = GetFormula()){
+        return formula -> GetMemoryUsage();
+    }
+    return 0;
 }
 
-std::string EmptyImpl::GetText() const {
-    return {};
-}
+// class FormulaImpl
 
-std::vector<Position> EmptyImpl::GetReferencedCells() const {
-    return {};
+FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula, const Sheet& sheet, Position pos)
+    : formula_(std::move(formula))
+    , sheet_(sheet)
+    , pos_(pos)
+    , value_(NO_VALUE){
 }
 
-CellInterface::Value TextImpl::GetValue() const {
-    if (text_[0] == ESCAPE_SIGN){
-        return text_.substr(1);
+CellInterface::Value FormulaImpl::GetValue() const {
+    if (cached_){
+        SHEET_PROFILE(sheet_.GetProfiler().CountHit(pos_));
+        return *UnpackValue(value_);
     }
-    return text_;
+    if (!evaluating.empty()){
+        if (evaluating.size() == MAX_NESTED_EVALUATIONS){
+            throw StaleReference{this, evaluating};
+        }
+        return Evaluate();
+    }
+    // Во время фонового пересчёта блокировка пуста: кеши меняет только он
+    if (const auto lock = sheet_.LockValues(); lock.owns_lock()){
+        EvaluateOnStack();
+        return *UnpackValue(value_);
+    }
+    return GetLastValue().value_or(CellInterface::Value{});
 }
 
-std::string TextImpl::GetText() const {
-    return text_;
+void FormulaImpl::Refresh() const {
+    if (!cached_){
+        EvaluateOnStack();
+    }
 }
 
-std::vector<Position> TextImpl::GetReferencedCells() const {
-    return {};
+CellInterface::Value FormulaImpl::Evaluate() const {
+    SHEET_PROFILE(RecalcProfiler::EvaluationScope scope(sheet_.GetProfiler(), pos_));
+    FormulaInterface::Value value = 0.0;
+    {
+        EvaluatingScope scope(this);
+        value = formula_ -> Evaluate(sheet_);
+    }
+    value_ = PackValue(value);
+    cached_ = true;
+    return std::visit([](auto result) -> CellInterface::Value { return result; }, value);
 }
 
-CellInterface::Value FormulaImpl::GetValue() const {
-    const auto value = ast_ -> Evaluate(sheet_);
-    if (std::holds_alternative<FormulaError>(value)){
-        return std::get<FormulaError>(value);
+void FormulaImpl::EvaluateOnStack() const {
+    // Обход в глубину: формула вычисляется при повторном снятии со стека,
+    // когда обязательные ячейки уже лежат в кеше. Ячейки выбранных ветвей IF
+    // и областей поиска формула вычисляет сама, вложенно. Слишком глубокое
+    // вложенное вычисление прерывается: прерванные формулы и нужная ячейка
+    // кладутся на стек, и формулы вычисляются заново уже по готовым значениям
+    std::vector<std::pair<const FormulaImpl*, bool>> stack{{this, false}};
+    const auto push = [this, &stack](Position pos){
+        const Cell* cell = sheet_.FindCell(pos);
+        const FormulaImpl* reff = cell ? cell -> GetFormula() : nullptr;
+        if (reff && reff -> NeedsEvaluation()){
+            stack.push_back({reff, false});
+        }
+    };
+
+    while (!stack.empty()){
+        const auto [formula, expanded] = stack.back();
+        if (!formula -> NeedsEvaluation()){
+            stack.pop_back();
+        } else if (!expanded){
+            stack.back().second = true;
+            for (const Position pos : formula -> GetRequiredCells()){
+                push(pos);
+            }
+        } else {
+            try {
+                formula -> Evaluate();
+                stack.pop_back();
+            } catch (const StaleReference& stale){
+                // Первая формула пути - сама formula, она уже на стеке
+                for (auto it = std::next(stale.path.begin()); it != stale.path.end(); ++it){
+                    stack.push_back({*it, false});
+                }
+                // Индекс области строится по всем её ячейкам: их формулы
+                // вычисляются заранее, чтобы построение не прерывалось на каждой
+                for (const CellRange& range : stale.path.back() -> GetReferencedRanges()){
+                    if (!range.Contains(stale.formula -> pos_)){
+                        continue;
+                    }
+                    for (int row = range.first.row; row <= range.last.row; ++row){
+                        for (int col = range.first.col; col <= range.last.col; ++col){
+                            push({row, col});
+                        }
+                    }
+                }
+                stack.push_back({stale.formula, false});
+            }
+        }
     }
-    return std::get<double>(value);
 }
 
 std::string FormulaImpl::GetText() const {
-    return FORMULA_SIGN + ast_ -> GetExpression();
+    return FORMULA_SIGN + formula_ -> GetExpression();
+}
+
+bool FormulaImpl::HasText(std::string_view text) const {
+    return text.size() > 1 && text[0] == FORMULA_SIGN && formula_ -> HasExpression(text.substr(1));
 }
 
 std::vector<Position> FormulaImpl::GetReferencedCells() const {
-    return ast_ -> GetReferencedCells();
+    return formula_ -> GetReferencedCells();
+}
+
+std::vector<CellRange> FormulaImpl::GetReferencedRanges() const {
+    return formula_ -> GetReferencedRanges();
+}
+
+std::vector<Position> FormulaImpl::GetRequiredCells() const {
+    return formula_ -> GetRequiredCells();
+}
+
+std::optional<CellInterface::Value> FormulaImpl::GetLastValue() const {
+    return UnpackValue(value_);
+}
+
+bool FormulaImpl::NeedsEvaluation() const {
+    return !cached_;
+}
+
+std::unique_ptr<FormulaInterface> FormulaImpl::Shift(int rows, int cols) const {
+    return formula_ -> Shift(rows, cols);
+}
+
+void FormulaImpl::ResetCache(){
+    cached_ = false;
+}
+
+size_t FormulaImpl::GetMemoryUsage() const {
+    return sizeof(FormulaImpl) + formula_ -> GetMemoryUsage();
 }
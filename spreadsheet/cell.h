@@ -3,9 +3,12 @@
 #include "common.h"
 #include "formula.h"
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <optional>
 #include <unordered_set>
+#include <variant>
 #include <vector>
 
 
@@ -15,94 +18,102 @@ struct PositionHash{
     }
 };
 
-class Impl {
-public:
-    virtual ~Impl() = default;
+class Sheet;
 
-    virtual CellInterface::Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
+// Формула ячейки вместе с кешем её значения. Таблицу и позицию хранят
+// только формульные ячейки: они нужны для вычисления и профилирования.
+// Передавать их при каждом вычислении нельзя: CellInterface::GetValue
+// вызывают без них и клиенты, и сами формулы через SheetInterface::GetCell
+class FormulaImpl {
+private:
+    std::unique_ptr<FormulaInterface> formula_;
+    const Sheet& sheet_;
+    Position pos_;
 
-class EmptyImpl : public Impl {
-public:
-    CellInterface::Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-};
+    // Кешируется число или ошибка, упакованные в 64 бита (см. cell.cpp),
+    // чтобы во время фонового пересчёта другие потоки читали значение без
+    // блокировок. После сброса кеша value_ хранит прежнее значение для
+    // GetLastValue, а cached_ становится false
+    mutable std::atomic<std::uint64_t> value_;
+    mutable std::atomic<bool> cached_{false};
 
-class TextImpl: public Impl {
-private:
-    std::string text_;
-public:
-    TextImpl(std::string text)
-        : text_(std::move(text))
-    {}
-    CellInterface::Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-};
+    // Вычисляет формулу вместе с устаревшими формулами, от которых она
+    // зависит, на явном стеке, чтобы длинная цепочка ссылок не переполняла
+    // стек вызовов
+    void EvaluateOnStack() const;
 
-class FormulaImpl: public Impl{
-private:
-    std::unique_ptr<FormulaInterface> ast_;
-    const SheetInterface& sheet_;
+    CellInterface::Value Evaluate() const;
 
-    std::vector<Position> refferenced_cells_;
 public:
-    FormulaImpl(std::string expression,  const SheetInterface& sheet)
-        : ast_(ParseFormula(expression))
-        , sheet_(sheet)
-        , refferenced_cells_(ast_ -> GetReferencedCells()){}
-
-    CellInterface::Value GetValue() const override;
-    std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
-};
+    FormulaImpl(std::unique_ptr<FormulaInterface> formula, const Sheet& sheet, Position pos);
+
+    // Пока идёт фоновый пересчёт, ничего не вычисляет и не ждёт: если кеш
+    // устарел, возвращает последнее посчитанное значение, а формула, ещё ни
+    // разу не вычисленная, читается как пустая
+    CellInterface::Value GetValue() const;
+    // Последнее посчитанное значение, даже если оно устарело; ничего не вычисляет
+    std::optional<CellInterface::Value> GetLastValue() const;
+    // Вычисляет формулу, если кеш устарел. Для фонового пересчёта
+    void Refresh() const;
+    std::string GetText() const;
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
+    // Ячейки, нужные при любом вычислении: все, кроме ветвей IF и областей поиска
+    std::vector<Position> GetRequiredCells() const;
+
+    // Задаёт ли text ту же формулу, что уже записана в ячейке
+    bool HasText(std::string_view text) const;
+
+    bool NeedsEvaluation() const;
+    void ResetCache();
 
+    // Копия формулы для ячейки, сдвинутой на rows строк и cols столбцов
+    std::unique_ptr<FormulaInterface> Shift(int rows, int cols) const;
 
-class Sheet;
+    size_t GetMemoryUsage() const;
+};
 
-class  Cell: public CellInterface {
+// Ячейка хранит своё содержимое без отдельного объекта реализации:
+// пустую ячейку, текст (короткие строки помещаются в сам std::string),
+// формулу или входное число, заданное через Sheet::SetNumber
+class Cell: public CellInterface {
 private:
-
-    mutable std::optional<double> value_;
-
-    Position current_pos_;
-
-    std::unique_ptr<Impl> impl_ = std::make_unique<EmptyImpl>();
-
-    Sheet* sheet_;
-
-    void CheckCircularDependency(const std::vector<Position>& reff_cells);
+    std::variant<std::monostate, std::string, std::unique_ptr<FormulaImpl>, double> content_;
 
 public:
-    explicit Cell(Sheet& sheet)
-        : sheet_(&sheet)
-    {
-    }
     CellInterface::Value GetValue() const override;
 
     std::string GetText() const override;
 
     std::vector<Position> GetReferencedCells() const override;
 
-    void ResetCache();
+    // Области функций поиска, на которые ссылается формула ячейки
+    std::vector<CellRange> GetReferencedRanges() const;
 
-    const std::unique_ptr<Impl>& GetImpl() const;
-    std::unique_ptr<Impl>& GetImpl();
+    // Не изменит ли SetCell(text) содержимое ячейки. В отличие от сравнения
+    // с GetText, формула совпадает и с исходным текстом, и с каноническим
+    bool HasText(std::string_view text) const;
 
-    Position& GetPos();
+    bool IsEmpty() const;
 
-    const Position& GetPos() const;
+    // Значение текстовой ячейки без копирования; пусто для остальных ячеек
+    std::string_view GetTextValue() const;
 
-    void SetPos(Position pos);
+    // Число входной ячейки или nullptr
+    const double* GetInput() const;
 
-    void Clear();
+    // nullptr, если в ячейке не формула
+    const FormulaImpl* GetFormula() const;
 
-    void Set(std::string text);
+    // Пустая строка делает ячейку пустой
+    void SetText(std::string text);
 
-    operator bool() const {
-        return impl_ != nullptr;
-    }
+    void SetFormula(std::unique_ptr<FormulaImpl> formula);
+
+    void SetInput(double value);
+
+    void ResetCache();
+
+    // Память, занятая содержимым ячейки вне самого объекта Cell
+    size_t GetHeapUsage() const;
 };
@@ -0,0 +1,80 @@
+#include "column_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
+
+ColumnIndex::ColumnIndex(const SheetInterface& sheet, int col, int first_row, int last_row){
+    values_.assign(last_row - first_row + 1, std::numeric_limits<double>::quiet_NaN());
+    for (int row = first_row; row <= last_row; ++row){
+        double& value = values_[row - first_row];
+        if (const auto number = sheet.GetNumber({row, col})){
+            value = *number;
+            continue;
+        }
+        const CellInterface* cell = sheet.GetCell({row, col});
+        if (!cell){
+            continue;
+        }
+        const CellInterface::Value cell_value = cell -> GetValue();
+        if (const double* number = std::get_if<double>(&cell_value)){
+            value = *number;
+        } else if (const std::string* text = std::get_if<std::string>(&cell_value); text && !text -> empty()){
+            value = ParseCellNumber(*text).value_or(value);
+        }
+    }
+}
+
+std::optional<int> ColumnIndex::FindEqual(double value) const {
+    if (!has_equal_){
+        equal_.reserve(values_.size());
+        // Обход с конца оставляет в таблице первую из равных строк
+        for (int row = static_cast<int>(values_.size()) - 1; row >= 0; --row){
+            if (!std::isnan(values_[row])){
+                equal_[values_[row]] = row;
+            }
+        }
+        has_equal_ = true;
+    }
+    const auto it = equal_.find(value);
+    return it != equal_.end() ? std::optional<int>(it -> second) : std::nullopt;
+}
+
+std::optional<int> ColumnIndex::FindLessOrEqual(double value) const {
+    const auto& sorted = GetSorted();
+    const auto it = std::upper_bound(sorted.begin(), sorted.end(), value,
+        [](double lhs, const std::pair<double, int>& rhs){
+            return lhs < rhs.first;
+        });
+    return it != sorted.begin() ? std::optional<int>(std::prev(it) -> second) : std::nullopt;
+}
+
+std::optional<int> ColumnIndex::FindGreaterOrEqual(double value) const {
+    const auto& sorted = GetSorted();
+    const auto it = std::lower_bound(sorted.begin(), sorted.end(), value,
+        [](const std::pair<double, int>& lhs, double rhs){
+            return lhs.first < rhs;
+        });
+    return it != sorted.end() ? std::optional<int>(it -> second) : std::nullopt;
+}
+
+const std::vector<std::pair<double, int>>& ColumnIndex::GetSorted() const {
+    if (!has_sorted_){
+        for (size_t row = 0; row < values_.size(); ++row){
+            if (!std::isnan(values_[row])){
+                sorted_.emplace_back(values_[row], static_cast<int>(row));
+            }
+        }
+        std::sort(sorted_.begin(), sorted_.end());
+        has_sorted_ = true;
+    }
+    return sorted_;
+}
+
+size_t ColumnIndex::GetMemoryUsage() const {
+    // Узел хеш-таблицы: указатель на следующий узел плюс слот в массиве корзин
+    constexpr size_t node_size = 2 * sizeof(void*) + sizeof(std::pair<const double, int>);
+    return values_.capacity() * sizeof(double) + equal_.size() * node_size
+           + sorted_.capacity() * sizeof(std::pair<double, int>);
+}
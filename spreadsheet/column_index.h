@@ -0,0 +1,43 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Числовые значения ячеек одного столбца на отрезке строк для функций поиска.
+// Хеш-таблица для точного совпадения и упорядоченный массив для
+// приближённого строятся при первом поиске своего вида. Ячейки без числа
+// (пустые, с нечисловым текстом, с ошибкой) не находятся никогда.
+// Найденная строка - смещение от первой строки отрезка
+class ColumnIndex {
+public:
+    // Читает значения ячеек, вычисляя формулы
+    ColumnIndex(const SheetInterface& sheet, int col, int first_row, int last_row);
+
+    // Первая строка со значением value
+    std::optional<int> FindEqual(double value) const;
+
+    // Строка с наибольшим значением не больше value, из равных - последняя
+    std::optional<int> FindLessOrEqual(double value) const;
+
+    // Строка с наименьшим значением не меньше value, из равных - первая
+    std::optional<int> FindGreaterOrEqual(double value) const;
+
+    size_t GetMemoryUsage() const;
+
+private:
+    // NaN там, где числа нет
+    std::vector<double> values_;
+
+    mutable bool has_equal_ = false;
+    mutable std::unordered_map<double, int> equal_;
+
+    // Пары (значение, строка) по возрастанию
+    mutable bool has_sorted_ = false;
+    mutable std::vector<std::pair<double, int>> sorted_;
+
+    const std::vector<std::pair<double, int>>& GetSorted() const;
+};
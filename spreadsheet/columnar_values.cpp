@@ -0,0 +1,22 @@
+#include "columnar_values.h"
+
+#include <limits>
+
+size_t ColumnarValues::GetIndex(int row, int col) const {
+    return static_cast<size_t>(col) * rows + row;
+}
+
+std::string_view ColumnarValues::GetText(size_t index) const {
+    return {texts.data() + text_offsets[index], text_offsets[index + 1] - text_offsets[index]};
+}
+
+void ColumnarValues::Reset(int rows, int cols){
+    this -> rows = rows;
+    this -> cols = cols;
+    const size_t count = static_cast<size_t>(rows) * cols;
+    kinds.assign(count, Kind::Empty);
+    numbers.assign(count, std::numeric_limits<double>::quiet_NaN());
+    errors.assign(count, FormulaError::Category::Value);
+    text_offsets.assign(count + 1, 0);
+    texts.clear();
+}
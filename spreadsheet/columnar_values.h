@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Значения прямоугольной области таблицы, разложенные по столбцам: значение
+// ячейки (row, col) области лежит в каждом массиве по индексу col * rows + row,
+// поэтому столбец - непрерывный отрезок любого массива. Буферы принадлежат
+// вызывающему: при повторной выгрузке той же области память не выделяется
+struct ColumnarValues {
+    enum class Kind : std::uint8_t {
+        Empty,
+        Text,
+        Number,
+        Error,
+    };
+
+    int rows = 0;
+    int cols = 0;
+
+    std::vector<Kind> kinds;
+    // Значение формулы или число, записанное в текстовой ячейке; иначе NaN
+    std::vector<double> numbers;
+    // Имеет смысл только для ячеек Kind::Error
+    std::vector<FormulaError::Category> errors;
+    // Значение текстовой ячейки i - texts[text_offsets[i], text_offsets[i + 1]),
+    // у остальных ячеек этот отрезок пуст
+    std::vector<size_t> text_offsets;
+    std::vector<char> texts;
+
+    size_t GetIndex(int row, int col) const;
+    std::string_view GetText(size_t index) const;
+
+    // Размечает массивы под пустую область rows x cols
+    void Reset(int rows, int cols);
+};
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <climits>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -13,19 +15,90 @@ struct Position {
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
+    constexpr bool operator==(Position rhs) const {
+        return row == rhs.row && col == rhs.col;
+    }
+
+    constexpr bool operator<(Position rhs) const {
+        return row < rhs.row || (row == rhs.row && col < rhs.col);
+    }
+
+    constexpr bool IsValid() const {
+        return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+    }
 
-    bool IsValid() const;
     std::string ToString() const;
 
-    static Position FromString(std::string_view str);
+    // Пишет позицию в buffer без выделения памяти и возвращает конец записи.
+    // Некорректная позиция не пишется. Буферу хватает MAX_STRING_LENGTH символов
+    constexpr char* ToChars(char* buffer) const;
+
+    // Разбирает позицию без выделения памяти, в том числе при компиляции
+    static constexpr Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
     static const Position NONE;
+
+    // Самая длинная запись корректной позиции: XFD16384
+    static constexpr int MAX_LETTERS = 3;
+    static constexpr int MAX_STRING_LENGTH = 8;
 };
 
+constexpr char* Position::ToChars(char* buffer) const {
+    if (!IsValid()) {
+        return buffer;
+    }
+    constexpr int letters_count = 26;
+    char letters[MAX_LETTERS] = {};
+    int count = 0;
+    for (int c = col; c >= 0; c = c / letters_count - 1) {
+        letters[count++] = static_cast<char>('A' + c % letters_count);
+    }
+    while (count > 0) {
+        *buffer++ = letters[--count];
+    }
+
+    char digits[MAX_STRING_LENGTH] = {};
+    for (int r = row + 1; r > 0; r /= 10) {
+        digits[count++] = static_cast<char>('0' + r % 10);
+    }
+    while (count > 0) {
+        *buffer++ = digits[--count];
+    }
+    return buffer;
+}
+
+constexpr Position Position::FromString(std::string_view str) {
+    constexpr Position none{-1, -1};
+    size_t letters = 0;
+    while (letters < str.size() && 'A' <= str[letters] && str[letters] <= 'Z') {
+        ++letters;
+    }
+    if (letters == 0 || letters > MAX_LETTERS || letters == str.size()) {
+        return none;
+    }
+
+    int col = 0;
+    for (size_t i = 0; i < letters; ++i) {
+        col = col * 26 + (str[i] - 'A' + 1);
+    }
+
+    // Строка, которая не помещается в int, - не позиция
+    long long row = 0;
+    for (size_t i = letters; i < str.size(); ++i) {
+        if (str[i] < '0' || '9' < str[i]) {
+            return none;
+        }
+        row = row * 10 + (str[i] - '0');
+        if (row > INT_MAX) {
+            return none;
+        }
+    }
+
+    return {static_cast<int>(row) - 1, col - 1};
+}
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -33,6 +106,26 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область ячеек от first до last включительно
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool operator==(CellRange rhs) const;
+
+    bool Contains(Position pos) const;
+
+    // k, если в области от 2^k до 2^(k+1) - 1 строк. Строку row содержат
+    // только области класса k, начатые после row - 2^(k+1)
+    int GetHeightClass() const;
+};
+
+// Упаковывает набор позиций (в любом порядке, с повторами) в прямоугольники:
+// соседние ячейки строки объединяются в отрезки, а одинаковые отрезки
+// соседних строк - в прямоугольники.
+// Результат упорядочен по левому верхнему углу.
+std::vector<CellRange> CompressToRanges(std::vector<Position> positions);
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -40,6 +133,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Arithmetic,  // некорректная арифметическая операция
+        NotAvailable,  // функция поиска не нашла значение
     };
 
     FormulaError(Category category);
@@ -92,6 +186,12 @@ public:
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Трактует значение текстовой ячейки как число так же, как это делают
+// формулы: весь текст должен быть записью числа. Иначе std::nullopt
+std::optional<double> ParseCellNumber(const std::string& text);
+
+class ColumnIndex;
+
 class SheetInterface {
 public:
     virtual ~SheetInterface() = default;
@@ -107,6 +207,19 @@ public:
 
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Число из текстовой ячейки, если таблица хранит его уже разобранным.
+    // std::nullopt не означает, что в ячейке не число
+    virtual std::optional<double> GetNumber(Position pos) const {
+        return std::nullopt;
+    }
+
+    // Индекс значений столбца col в строках от first_row до last_row для
+    // функций поиска. nullptr, если таблица индексов не хранит: тогда
+    // формула строит индекс сама на одно вычисление
+    virtual const ColumnIndex* GetColumnIndex(int col, int first_row, int last_row) const {
+        return nullptr;
+    }
 };
 
 std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
@@ -0,0 +1,346 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+
+namespace {
+    constexpr size_t MIN_COMPACT_SIZE = 1024;
+}
+
+void DependencyGraph::SetPrecedents(Position cell, const std::vector<Position>& precedents,
+                                    const std::vector<CellRange>& ranges){
+    const auto it = ids_.find(cell);
+    if (it == ids_.end() && precedents.empty() && ranges.empty()){
+        return;
+    }
+    const std::uint32_t id = it != ids_.end() ? it -> second : GetId(cell);
+
+    // Старые ссылки снимаются целиком, номера отпускаются уже после новых
+    // ссылок, чтобы не отдать номер ячейки, на которую снова сошлются
+    std::vector<std::uint32_t> old_ids(edges_.begin() + nodes_[id].precedents.offset,
+                                       edges_.begin() + nodes_[id].precedents.offset + nodes_[id].precedents.size);
+    for (const std::uint32_t precedent : old_ids){
+        Erase(nodes_[precedent].dependents, id);
+    }
+    nodes_[id].precedents.size = 0;
+
+    // Повторы отсеиваются отметками: номер ячейки получает отметку при
+    // первой ссылке на неё. Новые номера появляются в ходе цикла, поэтому
+    // отметки растут вместе с nodes_
+    Marks& marks = StartVisit(nodes_.size());
+    for (const Position pos : precedents){
+        const std::uint32_t precedent = GetId(pos);
+        if (marks.visited.size() <= precedent){
+            marks.visited.resize(nodes_.size(), 0);
+        }
+        if (marks.visited[precedent] == marks.epoch){
+            continue;
+        }
+        marks.visited[precedent] = marks.epoch;
+        Append(nodes_[id].precedents, precedent);
+        Append(nodes_[precedent].dependents, id);
+    }
+
+    // Области так же: сначала новые, потом отпускаются ставшие ненужными
+    std::vector<std::uint32_t> old_ranges;
+    if (const auto node_ranges = node_ranges_.find(id); node_ranges != node_ranges_.end()){
+        old_ranges = std::move(node_ranges -> second);
+        node_ranges_.erase(node_ranges);
+    }
+    for (const std::uint32_t range_id : old_ranges){
+        std::vector<std::uint32_t>& dependents = ranges_[range_id].dependents;
+        *std::find(dependents.begin(), dependents.end(), id) = dependents.back();
+        dependents.pop_back();
+    }
+    std::vector<std::uint32_t> new_ranges;
+    for (const CellRange range : ranges){
+        const std::uint32_t range_id = GetRangeId(range);
+        if (std::find(new_ranges.begin(), new_ranges.end(), range_id) == new_ranges.end()){
+            new_ranges.push_back(range_id);
+            ranges_[range_id].dependents.push_back(id);
+        }
+    }
+    if (!new_ranges.empty()){
+        node_ranges_[id] = std::move(new_ranges);
+    }
+    for (const std::uint32_t range_id : old_ranges){
+        if (ranges_[range_id].dependents.empty()){
+            ReleaseRange(range_id);
+        }
+    }
+
+    for (const std::uint32_t precedent : old_ids){
+        ReleaseIfUnused(precedent);
+    }
+    ReleaseIfUnused(id);
+
+    if (unused_edges_ > MIN_COMPACT_SIZE && unused_edges_ * 2 > edges_.size()){
+        Compact();
+    }
+}
+
+std::vector<Position> DependencyGraph::GetPrecedents(Position cell) const {
+    const auto it = ids_.find(cell);
+    return it != ids_.end() ? Collect(nodes_[it -> second].precedents) : std::vector<Position>{};
+}
+
+std::vector<Position> DependencyGraph::GetDependents(Position cell) const {
+    // Формула может встретиться и по ребру, и по нескольким своим областям
+    std::vector<Position> result;
+    Marks& marks = StartVisit(nodes_.size());
+    const auto collect = [&result, &marks](Position pos, std::uint32_t id){
+        if (marks.visited[id] != marks.epoch){
+            marks.visited[id] = marks.epoch;
+            result.push_back(pos);
+        }
+    };
+    ForEachNext(cell, FindId(cell), &Node::dependents, collect);
+    return result;
+}
+
+std::vector<CellRange> DependencyGraph::GetPrecedentRanges(Position cell) const {
+    std::vector<CellRange> result;
+    const auto it = node_ranges_.find(FindId(cell));
+    if (it != node_ranges_.end()){
+        for (const std::uint32_t range_id : it -> second){
+            result.push_back(ranges_[range_id].range);
+        }
+    }
+    return result;
+}
+
+std::vector<Position> DependencyGraph::GetAllPrecedents(Position cell) const {
+    std::vector<Position> result;
+    VisitPrecedents(cell, [&result](Position pos){
+        result.push_back(pos);
+        return true;
+    });
+    return result;
+}
+
+std::vector<Position> DependencyGraph::GetAllDependents(Position cell) const {
+    std::vector<Position> result;
+    VisitDependents(cell, [&result](Position pos){
+        result.push_back(pos);
+        return true;
+    });
+    return result;
+}
+
+std::vector<CellRange> DependencyGraph::Trace::GetRanges() const {
+    return CompressToRanges(cells);
+}
+
+DependencyGraph::Trace DependencyGraph::TracePrecedents(Position cell, TraceLimits limits) const {
+    return TraceFrom(cell, &Node::precedents, limits);
+}
+
+DependencyGraph::Trace DependencyGraph::TraceDependents(Position cell, TraceLimits limits) const {
+    return TraceFrom(cell, &Node::dependents, limits);
+}
+
+DependencyGraph::Trace DependencyGraph::TraceFrom(Position start, EdgeList Node::*edges,
+                                                  TraceLimits limits) const {
+    Trace trace;
+    if (limits.max_depth <= 0){
+        return trace;
+    }
+    Marks& marks = StartVisit(nodes_.size());
+    const std::uint32_t epoch = marks.epoch;
+    std::unordered_set<Position, PositionHash> loose;
+
+    std::vector<std::pair<Position, std::uint32_t>> level{{start, FindId(start)}};
+    if (level.back().second != NO_ID){
+        marks.visited[level.back().second] = epoch;
+    }
+    std::vector<std::pair<Position, std::uint32_t>> next_level;
+    const auto add = [&](Position pos, std::uint32_t id){
+        if (trace.truncated || (id == NO_ID ? loose.count(pos) != 0 : marks.visited[id] == epoch)){
+            return;
+        }
+        if (trace.cells.size() == limits.max_results){
+            trace.truncated = true;
+            return;
+        }
+        if (id == NO_ID){
+            loose.insert(pos);
+        } else {
+            marks.visited[id] = epoch;
+        }
+        trace.cells.push_back(pos);
+        next_level.push_back({pos, id});
+    };
+    for (int depth = 1; depth <= limits.max_depth && !level.empty() && !trace.truncated; ++depth){
+        next_level.clear();
+        for (const auto& [pos, id] : level){
+            ForEachNext(pos, id, edges, add);
+        }
+        level.swap(next_level);
+    }
+    return trace;
+}
+
+size_t DependencyGraph::GetNodeCount() const {
+    return ids_.size();
+}
+
+size_t DependencyGraph::GetMemoryUsage() const {
+    // Узел хеш-таблицы: указатель на следующий узел плюс сама пара
+    constexpr size_t id_size = sizeof(void*) + sizeof(std::pair<const Position, std::uint32_t>);
+    return nodes_.capacity() * sizeof(Node)
+        + edges_.capacity() * sizeof(std::uint32_t)
+        + (ids_.empty() ? 0 : ids_.bucket_count() * sizeof(void*)) + ids_.size() * id_size
+        + free_ids_.capacity() * sizeof(std::uint32_t)
+        + GetRangesMemoryUsage();
+}
+
+std::uint32_t DependencyGraph::FindId(Position pos) const {
+    const auto it = ids_.find(pos);
+    return it != ids_.end() ? it -> second : NO_ID;
+}
+
+std::uint32_t DependencyGraph::GetId(Position pos){
+    if (const auto it = ids_.find(pos); it != ids_.end()){
+        return it -> second;
+    }
+    std::uint32_t id;
+    if (!free_ids_.empty()){
+        id = free_ids_.back();
+        free_ids_.pop_back();
+        nodes_[id] = Node{pos, {}, {}};
+    } else {
+        id = static_cast<std::uint32_t>(nodes_.size());
+        nodes_.push_back(Node{pos, {}, {}});
+    }
+    ids_[pos] = id;
+    return id;
+}
+
+void DependencyGraph::ReleaseIfUnused(std::uint32_t id){
+    Node& node = nodes_[id];
+    const auto it = ids_.find(node.pos);
+    if (node.precedents.size != 0 || node.dependents.size != 0 || node_ranges_.count(id) != 0
+            || it == ids_.end() || it -> second != id){
+        return;
+    }
+    unused_edges_ += node.precedents.capacity + node.dependents.capacity;
+    ids_.erase(node.pos);
+    node = Node{};
+    free_ids_.push_back(id);
+}
+
+std::uint32_t DependencyGraph::GetRangeId(CellRange range){
+    const std::pair key{range.first, range.last};
+    if (const auto it = range_ids_.find(key); it != range_ids_.end()){
+        return it -> second;
+    }
+    std::uint32_t range_id;
+    if (!free_ranges_.empty()){
+        range_id = free_ranges_.back();
+        free_ranges_.pop_back();
+        ranges_[range_id] = RangeNode{range, {}};
+    } else {
+        range_id = static_cast<std::uint32_t>(ranges_.size());
+        ranges_.push_back(RangeNode{range, {}});
+    }
+    range_ids_[key] = range_id;
+    const int height_class = range.GetHeightClass();
+    for (int col = range.first.col; col <= range.last.col; ++col){
+        column_ranges_[col].insert({height_class, range.first.row, range_id});
+    }
+    return range_id;
+}
+
+void DependencyGraph::ReleaseRange(std::uint32_t range_id){
+    const CellRange range = ranges_[range_id].range;
+    const int height_class = range.GetHeightClass();
+    for (int col = range.first.col; col <= range.last.col; ++col){
+        ColumnRanges& ranges = column_ranges_.at(col);
+        ranges.erase({height_class, range.first.row, range_id});
+        if (ranges.empty()){
+            column_ranges_.erase(col);
+        }
+    }
+    range_ids_.erase({range.first, range.last});
+    ranges_[range_id] = RangeNode{};
+    free_ranges_.push_back(range_id);
+}
+
+size_t DependencyGraph::GetRangesMemoryUsage() const {
+    // Узел дерева: три указателя и цвет; узел хеш-таблицы: указатель на
+    // следующий узел плюс пара и слот в массиве корзин
+    constexpr size_t tree_node = 4 * sizeof(void*) + sizeof(std::pair<const std::pair<Position, Position>, std::uint32_t>);
+    constexpr size_t set_node = 4 * sizeof(void*) + sizeof(ColumnRanges::value_type);
+    constexpr size_t list_node = 2 * sizeof(void*) + sizeof(std::pair<const int, std::vector<std::uint32_t>>);
+    constexpr size_t column_node = 2 * sizeof(void*) + sizeof(std::pair<const int, ColumnRanges>);
+    size_t usage = ranges_.capacity() * sizeof(RangeNode) + free_ranges_.capacity() * sizeof(std::uint32_t)
+                   + range_ids_.size() * tree_node;
+    for (const RangeNode& range : ranges_){
+        usage += range.dependents.capacity() * sizeof(std::uint32_t);
+    }
+    for (const auto& [col, ranges] : column_ranges_){
+        usage += column_node + ranges.size() * set_node;
+    }
+    for (const auto& [id, range_ids] : node_ranges_){
+        usage += list_node + range_ids.capacity() * sizeof(std::uint32_t);
+    }
+    return usage;
+}
+
+void DependencyGraph::Append(EdgeList& list, std::uint32_t id){
+    if (list.size == list.capacity){
+        const std::uint32_t capacity = std::max<std::uint32_t>(2, list.capacity * 2);
+        const std::uint32_t offset = static_cast<std::uint32_t>(edges_.size());
+        edges_.resize(edges_.size() + capacity);
+        std::copy(edges_.begin() + list.offset, edges_.begin() + list.offset + list.size,
+                  edges_.begin() + offset);
+        unused_edges_ += list.capacity;
+        list.offset = offset;
+        list.capacity = capacity;
+    }
+    edges_[list.offset + list.size++] = id;
+}
+
+void DependencyGraph::Erase(EdgeList& list, std::uint32_t id){
+    const auto begin = edges_.begin() + list.offset;
+    const auto it = std::find(begin, begin + list.size, id);
+    if (it != begin + list.size){
+        *it = *(begin + list.size - 1);
+        --list.size;
+    }
+}
+
+void DependencyGraph::Compact(){
+    std::vector<std::uint32_t> edges;
+    edges.reserve(edges_.size() - unused_edges_);
+    for (Node& node : nodes_){
+        for (EdgeList* list : {&node.precedents, &node.dependents}){
+            const std::uint32_t offset = static_cast<std::uint32_t>(edges.size());
+            edges.insert(edges.end(), edges_.begin() + list -> offset,
+                         edges_.begin() + list -> offset + list -> size);
+            *list = {offset, list -> size, list -> size};
+        }
+    }
+    edges_ = std::move(edges);
+    unused_edges_ = 0;
+}
+
+DependencyGraph::Marks& DependencyGraph::StartVisit(size_t size){
+    thread_local Marks marks;
+    if (marks.visited.size() < size){
+        marks.visited.resize(size, 0);
+    }
+    if (++marks.epoch == 0){
+        std::fill(marks.visited.begin(), marks.visited.end(), 0);
+        marks.epoch = 1;
+    }
+    return marks;
+}
+
+std::vector<Position> DependencyGraph::Collect(const EdgeList& list) const {
+    std::vector<Position> result;
+    result.reserve(list.size);
+    for (std::uint32_t i = 0; i < list.size; ++i){
+        result.push_back(nodes_[edges_[list.offset + i]].pos);
+    }
+    return result;
+}
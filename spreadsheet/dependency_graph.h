@@ -0,0 +1,226 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Граф ссылок между ячейками в обе стороны: для каждой ячейки хранятся
+// ячейки, на которые она ссылается (precedents), и ячейки, которые
+// ссылаются на неё (dependents).
+// Ячейки получают плотные номера, а списки рёбер - это отрезки одного общего
+// массива номеров, как в CSR. Растущий список переезжает в конец массива,
+// а когда брошенных отрезков становится больше половины, массив уплотняется.
+// Области функций поиска хранятся отдельными узлами со списком ссылающихся
+// на них формул, а не ребром к каждой своей ячейке: ячейки области узлов не
+// получают, зависимые области находятся по столбцу и строке ячейки.
+class DependencyGraph {
+public:
+    // Ограничения обхода: глубина 1 - только прямые ссылки
+    struct TraceLimits {
+        int max_depth = INT_MAX;
+        size_t max_results = SIZE_MAX;
+    };
+
+    // Ячейки в порядке удаления от исходной, каждая один раз
+    struct Trace {
+        std::vector<Position> cells;
+        // Обход остановлен на max_results, хотя ячейки ещё оставались
+        bool truncated = false;
+
+        std::vector<CellRange> GetRanges() const;
+    };
+
+    // Заменяет все ссылки ячейки cell на ячейки precedents и области ranges
+    void SetPrecedents(Position cell, const std::vector<Position>& precedents,
+                       const std::vector<CellRange>& ranges = {});
+
+    // Прямые ссылки в обе стороны. GetPrecedents не включает ячейки областей,
+    // их дают GetPrecedentRanges. GetDependents включает формулы, области
+    // которых содержат cell
+    std::vector<Position> GetPrecedents(Position cell) const;
+    std::vector<Position> GetDependents(Position cell) const;
+    std::vector<CellRange> GetPrecedentRanges(Position cell) const;
+
+    // Транзитивные замыкания, без самой ячейки cell. Обходы по ссылкам
+    // перечисляют все ячейки областей, в том числе пустые
+    std::vector<Position> GetAllPrecedents(Position cell) const;
+    std::vector<Position> GetAllDependents(Position cell) const;
+
+    // Обход в ширину по уровням в пределах limits
+    Trace TracePrecedents(Position cell, TraceLimits limits) const;
+    Trace TraceDependents(Position cell, TraceLimits limits) const;
+
+    // Обходят транзитивное замыкание без рекурсии, каждую ячейку один раз.
+    // visit(Position) возвращает false, если идти дальше этой ячейки не нужно.
+    // visit не должен менять граф и начинать в том же потоке другие обходы.
+    // Константные методы можно вызывать из нескольких потоков одновременно
+    template <typename Visitor>
+    void VisitPrecedents(Position cell, Visitor visit) const {
+        Visit(cell, &Node::precedents, visit);
+    }
+
+    template <typename Visitor>
+    void VisitDependents(Position cell, Visitor visit) const {
+        Visit(cell, &Node::dependents, visit);
+    }
+
+    // Число ячеек, у которых есть хотя бы одна связь, кроме ячеек,
+    // попавших в граф только через области
+    size_t GetNodeCount() const;
+
+    size_t GetMemoryUsage() const;
+
+private:
+    // Номер ячейки, у которой нет узла
+    static constexpr std::uint32_t NO_ID = UINT32_MAX;
+
+    // Отрезок edges_
+    struct EdgeList {
+        std::uint32_t offset = 0;
+        std::uint32_t size = 0;
+        std::uint32_t capacity = 0;
+    };
+
+    struct Node {
+        Position pos;
+        EdgeList precedents;
+        EdgeList dependents;
+    };
+
+    // Область и номера ссылающихся на неё формул
+    struct RangeNode {
+        CellRange range;
+        std::vector<std::uint32_t> dependents;
+    };
+
+    // Тройки (класс высоты, первая строка, номер области) областей,
+    // задевающих столбец. Поиск по классам высоты не перебирает области
+    // других строк столбца
+    using ColumnRanges = std::set<std::tuple<int, int, std::uint32_t>>;
+
+    std::uint32_t FindId(Position pos) const;
+    std::uint32_t GetId(Position pos);
+    void ReleaseIfUnused(std::uint32_t id);
+    std::uint32_t GetRangeId(CellRange range);
+    void ReleaseRange(std::uint32_t range_id);
+    size_t GetRangesMemoryUsage() const;
+    void Append(EdgeList& list, std::uint32_t id);
+    void Erase(EdgeList& list, std::uint32_t id);
+    void Compact();
+    // Отметки посещения для обходов, свои у каждого потока: узел посещён,
+    // если его отметка равна эпохе текущего обхода, поэтому перед обходом
+    // ничего не очищается
+    struct Marks {
+        std::vector<std::uint32_t> visited;
+        std::uint32_t epoch = 0;
+    };
+
+    // Отметки потока не короче size с новой эпохой
+    static Marks& StartVisit(size_t size);
+    std::vector<Position> Collect(const EdgeList& list) const;
+    Trace TraceFrom(Position start, EdgeList Node::*edges, TraceLimits limits) const;
+
+    // Вызывает next(Position, номер) для соседей ячейки pos с номером id
+    // по рёбрам edges и областям. У ячеек областей номера может не быть
+    template <typename Callback>
+    void ForEachNext(Position pos, std::uint32_t id, EdgeList Node::*edges, Callback& next) const {
+        if (id != NO_ID){
+            const EdgeList& list = nodes_[id].*edges;
+            for (std::uint32_t i = 0; i < list.size; ++i){
+                const std::uint32_t next_id = edges_[list.offset + i];
+                next(nodes_[next_id].pos, next_id);
+            }
+        }
+        if (edges == &Node::dependents){
+            const auto it = column_ranges_.find(pos.col);
+            if (it == column_ranges_.end()){
+                return;
+            }
+            const ColumnRanges& ranges = it -> second;
+            for (auto range = ranges.begin(); range != ranges.end();){
+                const int height_class = std::get<0>(*range);
+                const int min_first_row = pos.row - (2 << height_class) + 1;
+                for (range = ranges.lower_bound({height_class, min_first_row, 0});
+                        range != ranges.end() && std::get<0>(*range) == height_class
+                        && std::get<1>(*range) <= pos.row; ++range){
+                    const RangeNode& node = ranges_[std::get<2>(*range)];
+                    if (node.range.last.row < pos.row){
+                        continue;
+                    }
+                    for (const std::uint32_t dependent : node.dependents){
+                        next(nodes_[dependent].pos, dependent);
+                    }
+                }
+                range = ranges.lower_bound({height_class + 1, INT_MIN, 0});
+            }
+        } else if (id != NO_ID){
+            const auto it = node_ranges_.find(id);
+            if (it == node_ranges_.end()){
+                return;
+            }
+            for (const std::uint32_t range_id : it -> second){
+                const CellRange range = ranges_[range_id].range;
+                for (int row = range.first.row; row <= range.last.row; ++row){
+                    for (int col = range.first.col; col <= range.last.col; ++col){
+                        next(Position{row, col}, FindId({row, col}));
+                    }
+                }
+            }
+        }
+    }
+
+    template <typename Visitor>
+    void Visit(Position start, EdgeList Node::*edges, Visitor& visit) const {
+        Marks& marks = StartVisit(nodes_.size());
+        const std::uint32_t epoch = marks.epoch;
+        // Ячейки областей без своего узла отмечаются отдельно. Саму start
+        // обход не встретит: граф без циклов
+        std::unordered_set<Position, PositionHash> loose;
+        std::vector<std::pair<Position, std::uint32_t>> stack{{start, FindId(start)}};
+        if (stack.back().second != NO_ID){
+            marks.visited[stack.back().second] = epoch;
+        }
+        const auto push = [&](Position pos, std::uint32_t id){
+            if (id == NO_ID){
+                if (!loose.insert(pos).second){
+                    return;
+                }
+            } else if (marks.visited[id] == epoch){
+                return;
+            } else {
+                marks.visited[id] = epoch;
+            }
+            if (visit(pos)){
+                stack.push_back({pos, id});
+            }
+        };
+        while (!stack.empty()){
+            const auto [pos, id] = stack.back();
+            stack.pop_back();
+            ForEachNext(pos, id, edges, push);
+        }
+    }
+
+    std::vector<Node> nodes_;
+    std::vector<std::uint32_t> edges_;
+    // Сколько элементов edges_ не принадлежит ни одному списку
+    size_t unused_edges_ = 0;
+    std::unordered_map<Position, std::uint32_t, PositionHash> ids_;
+    std::vector<std::uint32_t> free_ids_;
+
+    std::vector<RangeNode> ranges_;
+    std::vector<std::uint32_t> free_ranges_;
+    std::map<std::pair<Position, Position>, std::uint32_t> range_ids_;
+    std::unordered_map<int, ColumnRanges> column_ranges_;
+    // Номера областей, на которые ссылается формула с данным номером
+    std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> node_ranges_;
+};
@@ -3,11 +3,69 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
-#include <sstream>
+#include <list>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 using namespace std::literals;
 
+namespace {
+    bool IsWordChar(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '.';
+    }
+
+    bool IsComparisonChar(char c) {
+        return c == '<' || c == '>' || c == '=';
+    }
+
+    bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    // Передаёт visitor символы нормализованного текста по одному, пока тот
+    // возвращает true. Возвращает false, если обход прерван
+    template <typename Visitor>
+    bool VisitNormalized(std::string_view expression, Visitor visitor) {
+        char last = '\0';
+        for (size_t i = 0; i < expression.size(); ++i){
+            if (!IsSpace(expression[i])){
+                last = expression[i];
+                if (!visitor(last)){
+                    return false;
+                }
+                continue;
+            }
+            // Пробел значим только между двумя частями чисел или ссылок: "1 2" != "12",
+            // и между знаками сравнения: "< =" != "<="
+            size_t next = i;
+            while (next < expression.size() && IsSpace(expression[next])){
+                ++next;
+            }
+            if (next < expression.size()
+                && ((IsWordChar(last) && IsWordChar(expression[next]))
+                    || (IsComparisonChar(last) && IsComparisonChar(expression[next])))){
+                last = ' ';
+                if (!visitor(last)){
+                    return false;
+                }
+            }
+            i = next - 1;
+        }
+        return true;
+    }
+
+    // Сравнивает уже нормализованный текст с нормализацией expression, не строя её
+    bool IsSameFormula(std::string_view normalized, std::string_view expression) {
+        size_t matched = 0;
+        return VisitNormalized(expression, [normalized, &matched](char c){
+                   return matched < normalized.size() && normalized[matched++] == c;
+               })
+               && matched == normalized.size();
+    }
+}
+
 
 FormulaError::FormulaError(Category category)
     : category_(std::move(category))
@@ -27,6 +85,8 @@ std::string_view FormulaError::ToString() const {
             return "#ARITHM!"sv;
         case Category::Ref:
             return "#REF!"sv;
+        case Category::NotAvailable:
+            return "#N/A"sv;
         default:
             return "#VALUE!"sv;
     }
@@ -39,38 +99,172 @@ std::ostream& operator<<(std::ostream& out, FormulaError err){
 namespace {
     class Formula : public FormulaInterface {
     private:
-        FormulaAST ast_;
+        std::shared_ptr<const FormulaAST> ast_;
     public:
-        explicit Formula(std::string expression) try 
-            : ast_(ParseFormulaAST(expression)){
-        } catch (const std::exception& exc) {
-            throw FormulaException(exc.what());
+        explicit Formula(std::shared_ptr<const FormulaAST> ast)
+            : ast_(std::move(ast)){
         }
 
         Value Evaluate(const SheetInterface& sheet) const override {
             try {
-                return ast_.Execute(sheet);
+                return ast_ -> Execute(sheet);
             } catch (const FormulaError& err){
                 return err;
             }
         }
 
+        // Текст готов заранее: дерево неизменяемо и печатается при создании
         std::string GetExpression() const override {
-            std::ostringstream out;
-            ast_.PrintFormula(out);
-            return out.str();
+            return ast_ -> GetExpression();
+        }
+
+        bool HasExpression(std::string_view expression) const override {
+            return IsSameFormula(ast_ -> GetSource(), expression)
+                   || IsSameFormula(ast_ -> GetExpression(), expression);
         }
 
         std::vector<Position> GetReferencedCells() const override {
-            std::forward_list<Position> cell = ast_.GetCells();
-            cell.remove_if([](Position& pos){return !pos.IsValid();});
+            std::forward_list<Position> cell = ast_ -> GetCells();
+            // Углы областей и ячейки внутри них покрыты самими областями
+            const std::vector<CellRange>& ranges = ast_ -> GetRanges();
+            cell.remove_if([&ranges](Position& pos){
+                return !pos.IsValid() || std::any_of(ranges.begin(), ranges.end(), [pos](CellRange range){
+                    return range.Contains(pos);
+                });
+            });
             cell.unique();
             return {cell.begin(), cell.end()};
         }
+
+        std::vector<CellRange> GetReferencedRanges() const override {
+            return ast_ -> GetRanges();
+        }
+
+        std::vector<Position> GetRequiredCells() const override {
+            if (!ast_ -> HasConditionalCells()){
+                return GetReferencedCells();
+            }
+            return ast_ -> GetRequiredCells();
+        }
+
+        // Дерево разбора делится между всеми одинаковыми формулами
+        size_t GetMemoryUsage() const override;
+
+        std::unique_ptr<FormulaInterface> Shift(int rows, int cols) const override {
+            if (rows == 0 && cols == 0){
+                return std::make_unique<Formula>(ast_);
+            }
+            return std::make_unique<Formula>(std::make_shared<const FormulaAST>(ast_ -> Shift(rows, cols)));
+        }
     };
+
+    std::shared_ptr<const FormulaAST> ParseAST(const std::string& expression, std::string normalized) {
+        try {
+            FormulaAST ast = ParseFormulaAST(expression);
+            ast.SetSource(std::move(normalized));
+            return std::make_shared<const FormulaAST>(std::move(ast));
+        } catch (const std::exception& exc) {
+            throw FormulaException(exc.what());
+        }
+    }
+
+    // Вытесняет давно не использованные деревья разбора, когда их больше capacity_
+    class FormulaCache {
+    public:
+        std::shared_ptr<const FormulaAST> Get(const std::string& expression) {
+            const std::string key = NormalizeFormula(expression);
+            {
+                std::lock_guard guard(mutex_);
+                if (const auto it = index_.find(key); it != index_.end()){
+                    ++hits_;
+                    entries_.splice(entries_.begin(), entries_, it -> second);
+                    return it -> second -> ast;
+                }
+                ++misses_;
+            }
+
+            // Разбор идёт без блокировки, чтобы потоки не ждали друг друга
+            auto ast = ParseAST(expression, key);
+
+            std::lock_guard guard(mutex_);
+            if (capacity_ == 0 || index_.count(key) != 0){
+                return ast;
+            }
+            entries_.push_front({key, ast});
+            index_[entries_.front().key] = entries_.begin();
+            Shrink();
+            return ast;
+        }
+
+        // Сколько формул делят дерево ast, не считая ссылки из самого кэша
+        size_t CountUsers(const std::shared_ptr<const FormulaAST>& ast) const {
+            std::lock_guard guard(mutex_);
+            const auto it = index_.find(ast -> GetSource());
+            const bool cached = it != index_.end() && it -> second -> ast == ast;
+            return std::max<size_t>(ast.use_count() - (cached ? 1 : 0), 1);
+        }
+
+        FormulaCacheStats GetStats() const {
+            std::lock_guard guard(mutex_);
+            return {hits_, misses_, entries_.size(), capacity_};
+        }
+
+        void SetCapacity(size_t capacity) {
+            std::lock_guard guard(mutex_);
+            capacity_ = capacity;
+            Shrink();
+        }
+
+    private:
+        struct Entry {
+            std::string key;
+            std::shared_ptr<const FormulaAST> ast;
+        };
+
+        void Shrink() {
+            while (entries_.size() > capacity_){
+                index_.erase(entries_.back().key);
+                entries_.pop_back();
+            }
+        }
+
+        mutable std::mutex mutex_;
+        // От недавно использованных к давно использованным
+        std::list<Entry> entries_;
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> index_;
+        size_t capacity_ = 4096;
+        size_t hits_ = 0;
+        size_t misses_ = 0;
+    };
+
+    FormulaCache& GetFormulaCache() {
+        static FormulaCache cache;
+        return cache;
+    }
+
+    size_t Formula::GetMemoryUsage() const {
+        return sizeof(Formula) + ast_ -> GetMemoryUsage() / GetFormulaCache().CountUsers(ast_);
+    }
+}
+
+std::string NormalizeFormula(std::string_view expression) {
+    std::string result;
+    result.reserve(expression.size());
+    VisitNormalized(expression, [&result](char c){
+        result += c;
+        return true;
+    });
+    return result;
 }
 
+FormulaCacheStats GetFormulaCacheStats() {
+    return GetFormulaCache().GetStats();
+}
+
+void SetFormulaCacheCapacity(size_t capacity) {
+    GetFormulaCache().SetCapacity(capacity);
+}
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+    return std::make_unique<Formula>(GetFormulaCache().Get(expression));
 }
\ No newline at end of file
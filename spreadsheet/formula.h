@@ -5,6 +5,7 @@
 #include "FormulaAST.h"
 
 #include <memory>
+#include <string_view>
 #include <variant>
 #include <vector>
 
@@ -17,8 +18,48 @@ public:
 
     virtual std::string GetExpression() const = 0;
 
+    // Совпадает ли expression с текстом, из которого формула была разобрана,
+    // или с её каноническим видом с точностью до незначимых пробелов.
+    // Ничего не разбирает и не выделяет память
+    virtual bool HasExpression(std::string_view expression) const = 0;
+
+    // Ячейки, на которые ссылается формула, кроме ячеек областей
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Области функций поиска. Граф зависимостей хранит их целиком, не
+    // перечисляя ячейки
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+
+    // Ячейки, значения которых нужны при любом вычислении: все, кроме
+    // упомянутых только в ветвях IF
+    virtual std::vector<Position> GetRequiredCells() const = 0;
+
+    // Размер формулы в памяти вместе с деревом разбора, в байтах
+    virtual size_t GetMemoryUsage() const = 0;
+
+    // Та же формула, скопированная в ячейку на rows строк ниже и cols
+    // столбцов правее: все ссылки сдвинуты, ссылки за край таблицы
+    // становятся #REF!
+    virtual std::unique_ptr<FormulaInterface> Shift(int rows, int cols) const = 0;
+};
+
+
+// Разобранные формулы кешируются по тексту без незначимых пробелов, поэтому
+// одинаковые формулы разбираются один раз и делят одно дерево разбора.
+// Кеш общий для всех таблиц и потокобезопасен
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Текст формулы без пробелов, не влияющих на разбор
+std::string NormalizeFormula(std::string_view expression);
+
+struct FormulaCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t size = 0;
+    size_t capacity = 0;
 };
 
+FormulaCacheStats GetFormulaCacheStats();
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+// Нулевая ёмкость отключает кеширование
+void SetFormulaCacheCapacity(size_t capacity);
\ No newline at end of file
@@ -0,0 +1,181 @@
+#include "frozen_sheet.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+
+using namespace std::literals;
+
+CellInterface::Value FrozenCell::GetValue() const {
+    switch (kind_){
+        case Kind::Number:
+            return number_;
+        case Kind::Error:
+            return FormulaError(error_);
+        default:
+            return std::string(text_.substr(value_offset_));
+    }
+}
+
+std::string FrozenCell::GetText() const {
+    return std::string(text_);
+}
+
+std::vector<Position> FrozenCell::GetReferencedCells() const {
+    return {refs_, refs_ + refs_count_};
+}
+
+FrozenSheet::FrozenSheet(Size size, const std::vector<std::pair<Position, const CellInterface*>>& cells)
+    : size_(size){
+    std::vector<std::pair<Position, const CellInterface*>> sorted = cells;
+    std::sort(sorted.begin(), sorted.end(), [](const auto& lhs, const auto& rhs){
+        return lhs.first < rhs.first;
+    });
+
+    // Тексты и ссылки сначала собираются целиком, чтобы буферы больше не
+    // перевыделялись и ячейки могли хранить указатели в них
+    std::vector<std::string> texts;
+    std::vector<std::vector<Position>> refs;
+    texts.reserve(sorted.size());
+    refs.reserve(sorted.size());
+    size_t texts_size = 0;
+    size_t refs_size = 0;
+    for (const auto& [pos, cell] : sorted){
+        texts.push_back(cell -> GetText());
+        refs.push_back(cell -> GetReferencedCells());
+        texts_size += texts.back().size();
+        refs_size += refs.back().size();
+    }
+    texts_.reserve(texts_size);
+    refs_.reserve(refs_size);
+
+    cells_.resize(sorted.size());
+    for (size_t i = 0; i < sorted.size(); ++i){
+        FrozenCell& frozen = cells_[i];
+        frozen.pos_ = sorted[i].first;
+
+        const size_t text_begin = texts_.size();
+        texts_.insert(texts_.end(), texts[i].begin(), texts[i].end());
+        frozen.text_ = std::string_view(texts_.data() + text_begin, texts[i].size());
+
+        frozen.refs_ = refs_.data() + refs_.size();
+        frozen.refs_count_ = static_cast<std::uint32_t>(refs[i].size());
+        refs_.insert(refs_.end(), refs[i].begin(), refs[i].end());
+
+        const CellInterface::Value value = sorted[i].second -> GetValue();
+        if (const auto* number = std::get_if<double>(&value)){
+            frozen.kind_ = FrozenCell::Kind::Number;
+            frozen.number_ = *number;
+        } else if (const auto* error = std::get_if<FormulaError>(&value)){
+            frozen.kind_ = FrozenCell::Kind::Error;
+            frozen.error_ = error -> GetCategory();
+        } else {
+            frozen.value_offset_ = frozen.text_.size() - std::get<std::string>(value).size();
+            if (const auto number = ParseCellNumber(texts[i])){
+                frozen.has_number_ = true;
+                frozen.number_ = *number;
+            }
+        }
+    }
+
+    size_t capacity = 1;
+    while (capacity < cells_.size() * 2){
+        capacity *= 2;
+    }
+    slots_.assign(capacity, NO_CELL);
+    for (size_t i = 0; i < cells_.size(); ++i){
+        size_t slot = GetSlot(cells_[i].pos_);
+        while (slots_[slot] != NO_CELL){
+            slot = (slot + 1) & (slots_.size() - 1);
+        }
+        slots_[slot] = static_cast<std::uint32_t>(i);
+    }
+}
+
+size_t FrozenSheet::GetSlot(Position pos) const {
+    const std::uint64_t key = static_cast<std::uint64_t>(pos.row) * Position::MAX_COLS + pos.col;
+    return (key * 0x9E3779B97F4A7C15ull >> 32) & (slots_.size() - 1);
+}
+
+const FrozenCell* FrozenSheet::FindCell(Position pos) const {
+    for (size_t slot = GetSlot(pos); slots_[slot] != NO_CELL; slot = (slot + 1) & (slots_.size() - 1)){
+        const FrozenCell& cell = cells_[slots_[slot]];
+        if (cell.pos_ == pos){
+            return &cell;
+        }
+    }
+    return nullptr;
+}
+
+void FrozenSheet::SetCell(Position, std::string){
+    throw ReadOnlySheetException{"Frozen sheet can't be changed"s};
+}
+
+void FrozenSheet::ClearCell(Position){
+    throw ReadOnlySheetException{"Frozen sheet can't be changed"s};
+}
+
+const CellInterface* FrozenSheet::GetCell(Position pos) const {
+    if (!pos.IsValid()){
+        throw InvalidPositionException{"Wrong cell position, out of table"s};
+    }
+    if (const FrozenCell* cell = FindCell(pos)){
+        return cell;
+    }
+    return pos.col < size_.cols && pos.row < size_.rows ? &empty_cell_ : nullptr;
+}
+
+CellInterface* FrozenSheet::GetCell(Position pos){
+    // У FrozenCell нет изменяющих методов, отдавать её без const безопасно
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+Size FrozenSheet::GetPrintableSize() const {
+    return size_;
+}
+
+void FrozenSheet::PrintValues(std::ostream& out) const {
+    auto cell = cells_.begin();
+    for (int row = 0; row < size_.rows; ++row){
+        for (int col = 0; col < size_.cols; ++col){
+            if (cell != cells_.end() && cell -> pos_ == Position{row, col}){
+                std::visit([&out](auto&& element){out << element;}, cell -> GetValue());
+                ++cell;
+            }
+            if (col < size_.cols - 1){
+                out << '\t';
+            }
+        }
+        out << '\n';
+    }
+}
+
+void FrozenSheet::PrintTexts(std::ostream& out) const {
+    auto cell = cells_.begin();
+    for (int row = 0; row < size_.rows; ++row){
+        for (int col = 0; col < size_.cols; ++col){
+            if (cell != cells_.end() && cell -> pos_ == Position{row, col}){
+                out << cell -> text_;
+                ++cell;
+            }
+            if (col < size_.cols - 1){
+                out << '\t';
+            }
+        }
+        out << '\n';
+    }
+}
+
+std::optional<double> FrozenSheet::GetNumber(Position pos) const {
+    const FrozenCell* cell = FindCell(pos);
+    if (cell && cell -> has_number_){
+        return cell -> number_;
+    }
+    return std::nullopt;
+}
+
+size_t FrozenSheet::GetMemoryUsage() const {
+    return sizeof(FrozenSheet) + cells_.capacity() * sizeof(FrozenCell)
+        + texts_.capacity() + refs_.capacity() * sizeof(Position)
+        + slots_.capacity() * sizeof(std::uint32_t);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Исключение, выбрасываемое при попытке изменить замороженную таблицу
+class ReadOnlySheetException : public std::logic_error {
+public:
+    using std::logic_error::logic_error;
+};
+
+class FrozenSheet;
+
+// Ячейка замороженной таблицы: значение посчитано заранее, текст и ссылки
+// лежат в общих массивах таблицы
+class FrozenCell : public CellInterface {
+public:
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+private:
+    friend class FrozenSheet;
+
+    enum class Kind : std::uint8_t {
+        Text,
+        Number,
+        Error,
+    };
+
+    Position pos_;
+    Kind kind_ = Kind::Text;
+    // Текст ячейки хранит число, которое формулы прочитают из неё
+    bool has_number_ = false;
+    FormulaError::Category error_ = FormulaError::Category::Ref;
+    // Значение текстовой ячейки - текст без первых value_offset_ символов
+    std::uint8_t value_offset_ = 0;
+    double number_ = 0.0;
+    std::string_view text_;
+    const Position* refs_ = nullptr;
+    std::uint32_t refs_count_ = 0;
+};
+
+// Неизменяемый снимок таблицы. Все значения посчитаны при создании, поэтому
+// чтение ничего не кэширует и не меняет: любое число потоков может читать
+// таблицу одновременно без блокировок.
+// Ячейки лежат в одном массиве по строкам, их тексты и ссылки - в двух общих
+// буферах, а позиция находится за O(1) по открытой хеш-таблице индексов.
+class FrozenSheet : public SheetInterface {
+public:
+    // Вычисляет значения всех cells. Указатели нужны только на время вызова
+    FrozenSheet(Size size, const std::vector<std::pair<Position, const CellInterface*>>& cells);
+
+    FrozenSheet(FrozenSheet&&) = default;
+    FrozenSheet& operator=(FrozenSheet&&) = default;
+    FrozenSheet(const FrozenSheet&) = delete;
+    FrozenSheet& operator=(const FrozenSheet&) = delete;
+
+    // Бросают ReadOnlySheetException
+    void SetCell(Position pos, std::string text) override;
+    void ClearCell(Position pos) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& out) const override;
+    void PrintTexts(std::ostream& out) const override;
+
+    std::optional<double> GetNumber(Position pos) const override;
+
+    size_t GetMemoryUsage() const;
+
+private:
+    static constexpr std::uint32_t NO_CELL = UINT32_MAX;
+
+    const FrozenCell* FindCell(Position pos) const;
+    size_t GetSlot(Position pos) const;
+
+    Size size_;
+    FrozenCell empty_cell_;
+    std::vector<FrozenCell> cells_;
+    std::vector<char> texts_;
+    std::vector<Position> refs_;
+    // Индексы cells_ или NO_CELL; размер - степень двойки
+    std::vector<std::uint32_t> slots_;
+};
@@ -0,0 +1,461 @@
+// Случайные формулы для формульного движка: замеры скорости разбора,
+// вычисления и печати и дифференциальная проверка разбор -> печать -> разбор.
+//
+// formula_fuzz [fuzz|bench|positions|all] [iterations] [seed]
+
+#include "FormulaAST.h"
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace {
+    constexpr int SHEET_ROWS = 6;
+    constexpr int SHEET_COLS = 6;
+
+    using Value = FormulaInterface::Value;
+
+    // Содержимое ячеек случайной таблицы вместе с тем, что из них прочитает
+    // формула: число или ошибка
+    struct RandomSheet {
+        Sheet sheet;
+        std::vector<std::vector<Value>> values;
+    };
+
+    class Generator {
+    public:
+        explicit Generator(unsigned seed)
+            : random_(seed){
+        }
+
+        // Таблица хранит ссылки на себя в формулах и не перемещается,
+        // поэтому заполняется на месте
+        void FillSheet(RandomSheet& result){
+            result.values.assign(SHEET_ROWS, std::vector<Value>(SHEET_COLS, 0.0));
+            // Последние строка и столбец остаются пустыми
+            for (int row = 0; row + 1 < SHEET_ROWS; ++row){
+                for (int col = 0; col + 1 < SHEET_COLS; ++col){
+                    Value& value = result.values[row][col];
+                    switch (Uniform(0, 4)){
+                        case 0:
+                            break;
+                        case 1:
+                            result.sheet.SetCell({row, col}, "text");
+                            value = FormulaError(FormulaError::Category::Value);
+                            break;
+                        case 2:
+                            result.sheet.SetCell({row, col}, "=1/0");
+                            value = FormulaError(FormulaError::Category::Arithmetic);
+                            break;
+                        default: {
+                            const double number = MakeNumber();
+                            result.sheet.SetCell({row, col}, ToText(number));
+                            value = number;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Формула ровно из nodes узлов и её значение, посчитанное напрямую
+        std::pair<std::string, Value> MakeFormula(int nodes, const RandomSheet& sheet){
+            std::string text;
+            Value value = Make(nodes, sheet, text);
+            return {text, value};
+        }
+
+    private:
+        int Uniform(int from, int to){
+            return std::uniform_int_distribution<int>(from, to)(random_);
+        }
+
+        // Не больше шести значащих цифр: столько печатает PrintFormula
+        double MakeNumber(){
+            return Uniform(0, 1) == 0 ? Uniform(0, 99999) : Uniform(0, 99999) / 100.0;
+        }
+
+        static std::string ToText(double number){
+            std::ostringstream out;
+            out << number;
+            return out.str();
+        }
+
+        std::string Space(){
+            return Uniform(0, 3) == 0 ? " " : "";
+        }
+
+        Value Make(int nodes, const RandomSheet& sheet, std::string& text){
+            if (nodes == 1){
+                if (Uniform(0, 1) == 0){
+                    const double number = MakeNumber();
+                    text += ToText(number);
+                    return number;
+                }
+                const Position pos{Uniform(0, SHEET_ROWS - 1), Uniform(0, SHEET_COLS - 1)};
+                text += pos.ToString();
+                return sheet.values[pos.row][pos.col];
+            }
+
+            if (nodes == 2 || Uniform(0, 4) == 0){
+                const char sign = Uniform(0, 1) == 0 ? '+' : '-';
+                text += sign;
+                text += '(';
+                const Value operand = Make(nodes - 1, sheet, text);
+                text += ')';
+                if (sign == '-' && std::holds_alternative<double>(operand)){
+                    return -std::get<double>(operand);
+                }
+                return operand;
+            }
+
+            if (nodes >= 4 && Uniform(0, 9) == 0){
+                return MakeIf(nodes, sheet, text);
+            }
+            if (Uniform(0, 9) == 0){
+                return MakeComparison(nodes, sheet, text);
+            }
+
+            const int lhs_nodes = Uniform(1, nodes - 2);
+            const char sign = "+-*/"[Uniform(0, 3)];
+            text += '(';
+            const Value lhs = Make(lhs_nodes, sheet, text);
+            text += ')' + Space() + sign + Space() + '(';
+            const Value rhs = Make(nodes - 1 - lhs_nodes, sheet, text);
+            text += ')';
+
+            if (!std::holds_alternative<double>(lhs)){
+                return lhs;
+            }
+            if (!std::holds_alternative<double>(rhs)){
+                return rhs;
+            }
+            const double left = std::get<double>(lhs);
+            const double right = std::get<double>(rhs);
+            const double result = sign == '+' ? left + right
+                : sign == '-' ? left - right
+                : sign == '*' ? left * right
+                : left / right;
+            if (!std::isfinite(result)){
+                return FormulaError(FormulaError::Category::Arithmetic);
+            }
+            return result;
+        }
+
+        // Сравнение даёт 1 или 0, ошибка левого операнда важнее правой
+        Value MakeComparison(int nodes, const RandomSheet& sheet, std::string& text){
+            const int lhs_nodes = Uniform(1, nodes - 2);
+            const std::string sign = SIGNS[Uniform(0, 5)];
+            text += '(';
+            const Value lhs = Make(lhs_nodes, sheet, text);
+            text += ')' + Space() + sign + Space() + '(';
+            const Value rhs = Make(nodes - 1 - lhs_nodes, sheet, text);
+            text += ')';
+
+            if (!std::holds_alternative<double>(lhs)){
+                return lhs;
+            }
+            if (!std::holds_alternative<double>(rhs)){
+                return rhs;
+            }
+            const double left = std::get<double>(lhs);
+            const double right = std::get<double>(rhs);
+            const bool result = sign == "<" ? left < right
+                : sign == "<=" ? left <= right
+                : sign == ">" ? left > right
+                : sign == ">=" ? left >= right
+                : sign == "=" ? left == right
+                : left != right;
+            return result ? 1.0 : 0.0;
+        }
+
+        // Ошибка невыбранной ветви IF не влияет на значение
+        Value MakeIf(int nodes, const RandomSheet& sheet, std::string& text){
+            const int condition_nodes = Uniform(1, nodes - 3);
+            const int true_nodes = Uniform(1, nodes - 2 - condition_nodes);
+            text += "IF(";
+            const Value condition = Make(condition_nodes, sheet, text);
+            text += ',' + Space();
+            const Value if_true = Make(true_nodes, sheet, text);
+            text += ',' + Space();
+            const Value if_false = Make(nodes - 1 - condition_nodes - true_nodes, sheet, text);
+            text += ')';
+
+            if (!std::holds_alternative<double>(condition)){
+                return condition;
+            }
+            return std::get<double>(condition) != 0 ? if_true : if_false;
+        }
+
+        static constexpr const char* SIGNS[] = {"<", "<=", ">", ">=", "=", "<>"};
+
+        std::mt19937 random_;
+    };
+
+    // Прежние Position::FromString и Position::ToString: образец для сравнения
+    Position LegacyFromString(std::string_view str){
+        auto it = std::find_if(str.begin(), str.end(), [](const char c){
+            return !(std::isalpha(c) && std::isupper(c));
+        });
+        auto letters = str.substr(0, it - str.begin());
+        auto digits = str.substr(it - str.begin());
+        if (letters.empty() || digits.empty() || letters.size() > 3 || !std::isdigit(digits[0])){
+            return Position::NONE;
+        }
+        int row;
+        std::istringstream row_in{std::string{digits}};
+        if (!(row_in >> row) || !row_in.eof()){
+            return Position::NONE;
+        }
+        int col = 0;
+        for (char ch : letters){
+            col = col * 26 + ch - 'A' + 1;
+        }
+        return {row - 1, col - 1};
+    }
+
+    std::string LegacyToString(Position pos){
+        if (!pos.IsValid()){
+            return "";
+        }
+        std::string result;
+        result.reserve(17);
+        for (int c = pos.col; c >= 0; c = c / 26 - 1){
+            result.insert(result.begin(), 'A' + c % 26);
+        }
+        result += std::to_string(pos.row + 1);
+        return result;
+    }
+
+    Value Execute(const FormulaAST& ast, const SheetInterface& sheet){
+        try {
+            return ast.Execute(sheet);
+        } catch (const FormulaError& error){
+            return error;
+        }
+    }
+
+    std::string Print(const FormulaAST& ast){
+        return ast.GetExpression();
+    }
+
+    std::string ToString(const Value& value){
+        std::ostringstream out;
+        std::visit([&out](const auto& element){out << element;}, value);
+        return out.str();
+    }
+
+    // Печать опускает скобки вокруг сочетательных операций: A+(B+C) станет
+    // A+B+C. После повторного разбора сложение идёт в другом порядке, и
+    // результат может отличаться в последних разрядах
+    bool IsClose(const Value& lhs, const Value& rhs){
+        if (!std::holds_alternative<double>(lhs) || !std::holds_alternative<double>(rhs)){
+            return lhs == rhs;
+        }
+        const double left = std::get<double>(lhs);
+        const double right = std::get<double>(rhs);
+        return std::abs(left - right) <= 1e-9 * std::max({1.0, std::abs(left), std::abs(right)});
+    }
+
+    bool Report(const std::string& problem, const std::string& formula,
+                const std::string& expected, const std::string& actual){
+        std::cerr << problem << '\t' << formula << '\t' << expected << '\t' << actual << '\n';
+        return false;
+    }
+
+    // Значение формулы должно совпасть с посчитанным генератором, а
+    // напечатанная формула - разбираться в ту же самую формулу
+    bool CheckFormula(const std::string& text, const Value& expected, const SheetInterface& sheet){
+        const FormulaAST ast = ParseFormulaAST(text);
+        const Value value = Execute(ast, sheet);
+        if (!(value == expected)){
+            return Report("value", text, ToString(expected), ToString(value));
+        }
+
+        const std::string printed = Print(ast);
+        const FormulaAST reparsed = ParseFormulaAST(printed);
+        const Value reparsed_value = Execute(reparsed, sheet);
+        // Сдвиг в последних разрядах может перевернуть сравнение, и тогда
+        // значения расходятся целиком
+        const bool has_conditions = printed.find_first_of("<>=I") != std::string::npos;
+        if (!has_conditions && !IsClose(reparsed_value, expected)){
+            return Report("reparsed value", printed, ToString(expected), ToString(reparsed_value));
+        }
+        if (Print(reparsed) != printed){
+            return Report("canonical text", text, printed, Print(reparsed));
+        }
+
+        const Value cached_value = ParseFormula(text) -> Evaluate(sheet);
+        if (!(cached_value == expected)){
+            return Report("cached value", text, ToString(expected), ToString(cached_value));
+        }
+        return true;
+    }
+
+    // Случайные строки из букв, цифр и знаков разбираются так же, как прежде
+    int CheckPositions(int iterations, unsigned seed){
+        std::mt19937 random(seed);
+        const std::string alphabet = "ABXYZ0123456789a+- ";
+        int failures = 0;
+        for (int i = 0; i < iterations * 100; ++i){
+            std::string text(std::uniform_int_distribution<int>(0, 12)(random), ' ');
+            for (char& c : text){
+                c = alphabet[std::uniform_int_distribution<size_t>(0, alphabet.size() - 1)(random)];
+            }
+            const Position pos = Position::FromString(text);
+            if (!(pos == LegacyFromString(text)) || pos.ToString() != LegacyToString(pos)){
+                Report("position", text, LegacyFromString(text).ToString(), pos.ToString());
+                ++failures;
+            }
+        }
+        return failures;
+    }
+
+    int RunFuzz(int iterations, unsigned seed){
+        Generator generator(seed);
+        int failures = CheckPositions(iterations, seed);
+        for (int i = 0; i < iterations; ++i){
+            RandomSheet sheet;
+            generator.FillSheet(sheet);
+            for (int nodes = 1; nodes <= 40; ++nodes){
+                const auto [text, expected] = generator.MakeFormula(nodes, sheet);
+                if (!CheckFormula(text, expected, sheet.sheet)){
+                    ++failures;
+                }
+            }
+        }
+        std::cout << "fuzz\t" << iterations << " sheets\t" << failures << " failures\n";
+        return failures;
+    }
+
+    template <typename Action>
+    double MeasureNs(size_t count, Action action){
+        const auto start = std::chrono::steady_clock::now();
+        action();
+        const auto duration = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double, std::nano>(duration).count() / count;
+    }
+
+    // Среднее время на одну формулу по числу узлов
+    void RunBench(int iterations, unsigned seed){
+        Generator generator(seed);
+        RandomSheet sheet;
+        generator.FillSheet(sheet);
+
+        std::cout << "nodes\tparse_ns\texecute_ns\tprint_ns\tround_trip_ns\n";
+        for (const int nodes : {1, 4, 16, 64, 256}){
+            std::vector<std::string> texts;
+            for (int i = 0; i < iterations; ++i){
+                texts.push_back(generator.MakeFormula(nodes, sheet).first);
+            }
+
+            std::vector<FormulaAST> asts;
+            asts.reserve(texts.size());
+            const double parse = MeasureNs(texts.size(), [&](){
+                for (const auto& text : texts){
+                    asts.push_back(ParseFormulaAST(text));
+                }
+            });
+
+            constexpr int EXECUTIONS = 10;
+            // Не даёт компилятору выбросить замеряемые вызовы
+            volatile double sink = 0;
+            const double execute = MeasureNs(asts.size() * EXECUTIONS, [&](){
+                for (int i = 0; i < EXECUTIONS; ++i){
+                    for (const auto& ast : asts){
+                        const Value value = Execute(ast, sheet.sheet);
+                        sink = sink + (std::holds_alternative<double>(value) ? std::get<double>(value) : 0);
+                    }
+                }
+            });
+
+            std::vector<std::string> printed;
+            printed.reserve(asts.size());
+            const double print = MeasureNs(asts.size(), [&](){
+                for (const auto& ast : asts){
+                    printed.push_back(Print(ast));
+                }
+            });
+
+            const double round_trip = MeasureNs(asts.size(), [&](){
+                for (const auto& ast : asts){
+                    sink = sink + ParseFormulaAST(Print(ast)).GetCells().empty();
+                }
+            });
+
+            std::cout << nodes << '\t' << parse << '\t' << execute << '\t' << print << '\t' << round_trip << '\n';
+        }
+    }
+
+    // Среднее время на одну позицию, прежняя и новая реализации
+    void RunPositionBench(int iterations){
+        std::vector<Position> positions;
+        std::vector<std::string> texts;
+        for (int i = 0; i < iterations * 100; ++i){
+            positions.push_back({i * 7919 % Position::MAX_ROWS, i * 104729 % Position::MAX_COLS});
+            texts.push_back(positions.back().ToString());
+        }
+
+        volatile int sink = 0;
+        const double legacy_from = MeasureNs(texts.size(), [&](){
+            for (const auto& text : texts){
+                sink = sink + LegacyFromString(text).row;
+            }
+        });
+        const double from = MeasureNs(texts.size(), [&](){
+            for (const auto& text : texts){
+                sink = sink + Position::FromString(text).row;
+            }
+        });
+        const double legacy_to = MeasureNs(positions.size(), [&](){
+            for (const auto pos : positions){
+                sink = sink + static_cast<int>(LegacyToString(pos).size());
+            }
+        });
+        const double to_string = MeasureNs(positions.size(), [&](){
+            for (const auto pos : positions){
+                sink = sink + static_cast<int>(pos.ToString().size());
+            }
+        });
+        const double to_chars = MeasureNs(positions.size(), [&](){
+            char buffer[Position::MAX_STRING_LENGTH];
+            for (const auto pos : positions){
+                sink = sink + static_cast<int>(pos.ToChars(buffer) - buffer);
+            }
+        });
+
+        std::cout << "operation\tlegacy_ns\tcurrent_ns\n"
+                  << "FromString\t" << legacy_from << '\t' << from << '\n'
+                  << "ToString\t" << legacy_to << '\t' << to_string << '\n'
+                  << "ToChars\t" << legacy_to << '\t' << to_chars << '\n';
+    }
+}
+
+int main(int argc, char* argv[]){
+    const std::string mode = argc > 1 ? argv[1] : "all";
+    const int iterations = argc > 2 ? std::atoi(argv[2]) : 1000;
+    const unsigned seed = argc > 3 ? static_cast<unsigned>(std::atoi(argv[3])) : std::random_device{}();
+    std::cout << "seed\t" << seed << '\n';
+
+    int failures = 0;
+    if (mode == "fuzz" || mode == "all"){
+        failures = RunFuzz(iterations, seed);
+    }
+    if (mode == "bench" || mode == "all"){
+        RunBench(iterations, seed);
+    }
+    if (mode == "positions" || mode == "all"){
+        RunPositionBench(iterations);
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,13 +1,27 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <limits>
+#include <thread>
 
 #include "common.h"
+#include "FormulaAST.h"
 #include "formula.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "worker_pool.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
+using namespace std::literals;
+
 inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
@@ -16,6 +30,10 @@ inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
 
+inline std::ostream& operator<<(std::ostream& output, CellRange range) {
+    return output << range.first << ":" << range.last;
+}
+
 inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
     std::visit(
         [&](const auto& x) {
@@ -53,6 +71,32 @@ void TestPositionAndStringConversion() {
     testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
 }
 
+void TestPositionChars() {
+    static_assert(Position::FromString("C137") == Position{136, 2});
+    static_assert(!Position::FromString("A0").IsValid());
+    static_assert(Position::FromString("A2147483648") == Position::FromString(""));
+
+    constexpr auto to_chars = [](Position pos) {
+        std::array<char, Position::MAX_STRING_LENGTH + 1> buffer{};
+        pos.ToChars(buffer.data());
+        return buffer;
+    };
+    static_assert(to_chars({Position::MAX_ROWS - 1, Position::MAX_COLS - 1})[7] == '4');
+
+    char buffer[Position::MAX_STRING_LENGTH];
+    ASSERT_EQUAL(std::string(buffer, Position{0, 27}.ToChars(buffer)), "AB1");
+    ASSERT((Position{-1, 0}.ToChars(buffer) == buffer));
+
+    for (int row = 0; row < Position::MAX_ROWS; row += 97) {
+        for (int col = 0; col < Position::MAX_COLS; col += 89) {
+            const Position pos{row, col};
+            ASSERT_EQUAL(Position::FromString(std::string_view(buffer, pos.ToChars(buffer) - buffer)), pos);
+        }
+    }
+    ASSERT_EQUAL(Position::FromString("A01"), (Position{0, 0}));
+    ASSERT(!Position::FromString("A1 ").IsValid());
+}
+
 void TestPositionToStringInvalid() {
     ASSERT_EQUAL((Position{-1, -1}).ToString(), "");
     ASSERT_EQUAL((Position{-10, 0}).ToString(), "");
@@ -171,10 +215,88 @@ void TestFormulaExpressionFormatting() {
 
     ASSERT_EQUAL(reformat("  1  "), "1");
     ASSERT_EQUAL(reformat("  -1  "), "-1");
+    ASSERT_EQUAL(reformat("C1/-(A1*B1)"), "C1/-(A1*B1)");
+    ASSERT_EQUAL(reformat("C1/+(A1/B1)"), "C1/+(A1/B1)");
     ASSERT_EQUAL(reformat("2 + 2"), "2+2");
     ASSERT_EQUAL(reformat("(2*3)+4"), "2*3+4");
     ASSERT_EQUAL(reformat("(2*3)-4"), "2*3-4");
     ASSERT_EQUAL(reformat("( ( (  1) ) )"), "1");
+
+    // Numbers are printed exactly as operator<< prints them
+    for (const std::string number : {"0.1", "1234567", "1e20", "1e-7", "123456.5", "0.000123456789"}) {
+        std::ostringstream out;
+        out << std::stod(number);
+        ASSERT_EQUAL(reformat(number), out.str());
+    }
+    ASSERT_EQUAL(reformat("1e20 / 3"), "1e+20/3");
+    ASSERT_EQUAL(ParseFormula("A1 + 2")->Shift(1, 1)->GetExpression(), "B2+2");
+}
+
+void TestFormulaConstantFolding() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+
+    sheet->SetCell("B1"_pos, "=1+2*3+A1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=1+2*3+A1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(9.0));
+
+    sheet->SetCell("B2"_pos, "=(A1*1)+0");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetText(), "=A1*1+0");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet->SetCell("B3"_pos, "=+(-(4/2))/1-0");
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetText(), "=+-(4/2)/1-0");
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(-2.0));
+
+    sheet->SetCell("B4"_pos, "=1/0*1+A1");
+    ASSERT_EQUAL(sheet->GetCell("B4"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    // A1*1 has to keep the #ARITHM! check even though the multiplication is folded away
+    sheet->SetCell("A1"_pos, "inf");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+}
+
+void TestFormulaCache() {
+    ASSERT_EQUAL(NormalizeFormula(" A1 +\t( 2 * B2 ) "), "A1+(2*B2)");
+    ASSERT_EQUAL(NormalizeFormula("1  2"), "1 2");
+    ASSERT_EQUAL(NormalizeFormula("1 .5+1e 5"), "1 .5+1e 5");
+
+    const auto before = GetFormulaCacheStats();
+    auto first = ParseFormula("C1 + 42*D7");
+    auto second = ParseFormula("C1+42 * D7");
+    const auto after = GetFormulaCacheStats();
+    ASSERT_EQUAL(after.misses, before.misses + 1);
+    ASSERT_EQUAL(after.hits, before.hits + 1);
+    ASSERT_EQUAL(second->GetExpression(), "C1+42*D7");
+    ASSERT_EQUAL(second->GetReferencedCells(), (std::vector{"C1"_pos, "D7"_pos}));
+
+    bool caught = false;
+    try {
+        ParseFormula("1 2");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // A tree is shared between formulas, but the cache's own reference is not a user
+    auto single = ParseFormula("F1*3+G2");
+    const size_t single_usage = single->GetMemoryUsage();
+    auto twin = ParseFormula("F1*3 + G2");
+    ASSERT(twin->GetMemoryUsage() < single_usage);
+    ASSERT_EQUAL(single->GetMemoryUsage(), twin->GetMemoryUsage());
+    twin.reset();
+    ASSERT_EQUAL(single->GetMemoryUsage(), single_usage);
+
+    SetFormulaCacheCapacity(1);
+    ParseFormula("E5");
+    ASSERT_EQUAL(GetFormulaCacheStats().size, 1u);
+    ASSERT_EQUAL(single->GetMemoryUsage(), single_usage);
+    const auto misses = GetFormulaCacheStats().misses;
+    ParseFormula("C1+42*D7");
+    ASSERT_EQUAL(GetFormulaCacheStats().misses, misses + 1);
+    SetFormulaCacheCapacity(before.capacity);
 }
 
 void TestFormulaReferencedCells() {
@@ -191,6 +313,187 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestLookupFunctions() {
+    ASSERT_EQUAL(ParseFormula("VLOOKUP( 2 , A1 : B3 , 2 )")->GetExpression(), "VLOOKUP(2,A1:B3,2)");
+    ASSERT_EQUAL(ParseFormula("INDEX(B3:A1,(1+1),1)")->GetExpression(), "INDEX(B3:A1,1+1,1)");
+    ASSERT_EQUAL(ParseFormula("MATCH(C1,A1:A3,0)")->GetReferencedCells(), std::vector{"C1"_pos});
+    ASSERT(ParseFormula("MATCH(A2,A3:A1,0)")->GetReferencedRanges() == (std::vector{CellRange{"A1"_pos, "A3"_pos}}));
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "10");
+    sheet.SetCell("A2"_pos, "=15+5");
+    sheet.SetNumber("A3"_pos, 30);
+    sheet.SetCell("A4"_pos, "text");
+    sheet.SetCell("A5"_pos, "40");
+    for (int row = 0; row < 5; ++row) {
+        sheet.SetCell({row, 1}, std::to_string(row + 1));
+    }
+    const auto value = [&sheet](std::string formula) {
+        sheet.SetCell("C1"_pos, "=" + formula);
+        return sheet.GetCell("C1"_pos)->GetValue();
+    };
+    const auto error = [](FormulaError::Category category) {
+        return CellInterface::Value(FormulaError(category));
+    };
+
+    ASSERT_EQUAL(value("VLOOKUP(20,A1:B5,2,0)"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("VLOOKUP(35,A1:B5,2)"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("VLOOKUP(5,A1:B5,2)"), error(FormulaError::Category::NotAvailable));
+    ASSERT_EQUAL(value("VLOOKUP(10,A1:B5,3)"), error(FormulaError::Category::Ref));
+    ASSERT_EQUAL(value("VLOOKUP(10,A1:B5,0)"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(value("MATCH(40,A1:A5,0)"), CellInterface::Value(5.0));
+    ASSERT_EQUAL(value("MATCH(25,A5:A1,-1)"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("MATCH(40,A1:B5)"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(value("INDEX(A1:B5,3.9,2)"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value("INDEX(A1:B5,4)"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(FormulaError(FormulaError::Category::NotAvailable).ToString(), "#N/A");
+
+    // The index of A1:A5 is built once, dropped on edits and rebuilt on the next lookup
+    value("VLOOKUP(20,A1:B5,2,0)");
+    ASSERT(sheet.GetMemoryUsage().index_bytes > 0);
+    sheet.SetCell("A2"_pos, "=5");
+    ASSERT_EQUAL(sheet.GetMemoryUsage().index_bytes, 0u);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), error(FormulaError::Category::NotAvailable));
+    sheet.SetNumber("A3"_pos, 20);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // Sheets without indexes fall back to a temporary one
+    const FrozenSheet frozen = sheet.Freeze();
+    ASSERT(ParseFormula("VLOOKUP(12,A1:B5,2)")->Evaluate(frozen) == FormulaInterface::Value(1.0));
+
+    bool caught = false;
+    try {
+        sheet.SetCell("A4"_pos, "=MATCH(1,A1:A5,0)");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    sheet.CopyRange({"C1"_pos, "C1"_pos}, "D2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=VLOOKUP(20,B2:C6,2,0)");
+
+    // A range is a single node of the dependency graph, not an edge per cell
+    Sheet table;
+    table.SetCell("J1"_pos, "=VLOOKUP(1,A1:H16384,8)");
+    table.SetCell("J2"_pos, "=J1+MATCH(1,A1:A16384,0)");
+    const DependencyGraph& graph = table.GetDependencies();
+    ASSERT(table.GetMemoryUsage().dependency_bytes < 4096);
+    ASSERT_EQUAL(graph.GetDependents("A16384"_pos), (std::vector{"J1"_pos, "J2"_pos}));
+    ASSERT_EQUAL(graph.GetDependents("H1"_pos), std::vector{"J1"_pos});
+    ASSERT(graph.GetPrecedentRanges("J1"_pos) == (std::vector{CellRange{"A1"_pos, "H16384"_pos}}));
+    ASSERT_EQUAL(graph.GetAllPrecedents("J1"_pos).size(), 8u * 16384u);
+    ASSERT_EQUAL(table.TraceDependents("B7"_pos).cells, (std::vector{"J1"_pos, "J2"_pos}));
+
+    table.SetCell("A9"_pos, "=1");
+    table.SetCell("H9"_pos, "7");
+    ASSERT_EQUAL(table.GetCell("J2"_pos)->GetValue(), CellInterface::Value(16.0));
+    caught = false;
+    try {
+        table.SetCell("H100"_pos, "=J2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    table.SetCell("K3"_pos, "=S2");
+    caught = false;
+    try {
+        table.CopyRange({"K3"_pos, "K3"_pos}, "B2"_pos);
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    table.ClearCell("J1"_pos);
+    table.ClearCell("J2"_pos);
+    table.ClearCell("K3"_pos);
+    ASSERT(graph.GetDependents("A1"_pos).empty());
+    ASSERT_EQUAL(graph.GetNodeCount(), 0u);
+}
+
+void TestSpecializedShapes() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1e308");
+    sheet.SetCell("A2"_pos, "1e308");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("A4"_pos, "=1/0");
+    sheet.SetCell("A5"_pos, "2");
+    const auto value = [&sheet](std::string formula) {
+        sheet.SetCell("B1"_pos, "=" + formula);
+        return sheet.GetCell("B1"_pos)->GetValue();
+    };
+    const auto error = [](FormulaError::Category category) {
+        return CellInterface::Value(FormulaError(category));
+    };
+
+    ASSERT_EQUAL(value("A5*A5"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value("A5-3"), CellInterface::Value(-1.0));
+    ASSERT_EQUAL(value("3/A5"), CellInterface::Value(1.5));
+    ASSERT_EQUAL(value("1/C1"), error(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value("A5+A5+A5+C1"), CellInterface::Value(6.0));
+
+    // Errors keep the order of the generic tree: the left operand first, and
+    // every partial sum is checked before the next cell is read
+    ASSERT_EQUAL(value("A3/A4"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(value("A4/A3"), error(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value("A1+A2+A3"), error(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value("A5+A3+A4"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(value("A5+(A1+A2)"), error(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value("A1*10"), error(FormulaError::Category::Arithmetic));
+
+    // Printing and copying see the original tree
+    ASSERT_EQUAL(value("(A5+A5)+A5"), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A5+A5+A5");
+    sheet.CopyRange({"B1"_pos, "B1"_pos}, "B2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A6+A6+A6");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestConditionals() {
+    ASSERT_EQUAL(ParseFormula("1 <= 2")->GetExpression(), "1<=2");
+    ASSERT_EQUAL(ParseFormula("(A1<B1)<C1")->GetExpression(), "A1<B1<C1");
+    ASSERT_EQUAL(ParseFormula("A1<(B1<C1)")->GetExpression(), "A1<(B1<C1)");
+    ASSERT_EQUAL(ParseFormula("(A1<>B1)+1")->GetExpression(), "(A1<>B1)+1");
+    ASSERT_EQUAL(ParseFormula("-(1=2)")->GetExpression(), "-(1=2)");
+    ASSERT_EQUAL(ParseFormula("IF( A1 >= 0 , (B1), C1 )")->GetExpression(), "IF(A1>=0,B1,C1)");
+    ASSERT_EQUAL(ParseFormula("IF(A1,B1,C1)")->GetReferencedCells(),
+                 (std::vector{"A1"_pos, "B1"_pos, "C1"_pos}));
+
+    bool caught = false;
+    try {
+        ParseFormula("1 < = 2");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=(1<2)+(2>=3)*10+(1<>1)*100");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+    sheet.SetCell("A2"_pos, "=IF(1,2,1/0)");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    sheet.SetCell("A3"_pos, "=IF(1/0,1,2)");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+
+    // The untaken branch is not evaluated, even through other formulas
+    sheet.SetCell("B1"_pos, "0");
+    sheet.SetCell("C1"_pos, "=D1+1");
+    sheet.SetCell("B2"_pos, "=IF(B1>0,C1,-1)");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(-1.0));
+    ASSERT(!sheet.GetLastValue("C1"_pos));
+    sheet.SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // Both branches still count as dependencies
+    caught = false;
+    try {
+        sheet.SetCell("C1"_pos, "=IF(0,B2,1)");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -344,11 +647,912 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestFormulaParserReuse() {
+    auto evaluate = [](const std::string& expr) {
+        return ParseFormulaAST(expr).Execute(*CreateSheet());
+    };
+    ASSERT_EQUAL(evaluate("1+2*3"), 7.0);
+    for (std::string_view broken : {"1+", "(1", "1 2", "A1A"}) {
+        try {
+            ParseFormulaAST(broken);
+            ASSERT(false);
+        } catch (const std::exception&) {
+        }
+        ASSERT_EQUAL(evaluate("(1+2)*3"), 9.0);
+    }
+
+    std::istringstream in("4/2");
+    ASSERT_EQUAL(ParseFormulaAST(in).Execute(*CreateSheet()), 2.0);
+
+    double other_thread = 0;
+    std::thread([&other_thread, &evaluate] { other_thread = evaluate("-2--3"); }).join();
+    ASSERT_EQUAL(other_thread, 1.0);
+}
+
+void TestLongReferenceChain() {
+    Sheet sheet;
+    constexpr int length = 100000;
+    const auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    sheet.SetCell(chain_pos(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+    ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(),
+                    CellInterface::Value(double(length)));
+
+    sheet.SetCell(chain_pos(0), "=1/0");
+    ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    bool caught = false;
+    try {
+        sheet.SetCell(chain_pos(0), "=" + chain_pos(length - 1).ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestLongConditionalChain() {
+    constexpr int length = 100000;
+    const auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+
+    // Cells of taken branches and lookup ranges are not known before the
+    // evaluation, and still must not be evaluated recursively. '#' is the
+    // previous cell of the chain
+    for (const std::string pattern : {"IF(1>0,#+1,0)", "IF(CV1,#+1,0)", "INDEX(#:#,1)+1",
+                                      "VLOOKUP(1000000000,#:#,1)+1"}) {
+        Sheet sheet;
+        sheet.SetCell("CV1"_pos, "1");
+        sheet.SetCell(chain_pos(0), "1");
+        for (int i = 1; i < length; ++i) {
+            std::string formula = "=";
+            for (const char c : pattern) {
+                formula += c == '#' ? chain_pos(i - 1).ToString() : std::string(1, c);
+            }
+            sheet.SetCell(chain_pos(i), formula);
+        }
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(),
+                        CellInterface::Value(double(length)));
+
+        sheet.SetCell(chain_pos(0), "2");
+        ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(),
+                        CellInterface::Value(double(length + 1)));
+    }
+}
+
+void TestCompressToRanges() {
+    ASSERT(CompressToRanges({}).empty());
+    ASSERT_EQUAL(CompressToRanges({"B2"_pos, "A1"_pos, "B1"_pos, "A2"_pos, "A1"_pos, "D1"_pos}),
+                    (std::vector<CellRange>{{"A1"_pos, "B2"_pos}, {"D1"_pos, "D1"_pos}}));
+    ASSERT_EQUAL(CompressToRanges({"A1"_pos, "A3"_pos, "B2"_pos}),
+                    (std::vector<CellRange>{{"A1"_pos, "A1"_pos}, {"B2"_pos, "B2"_pos},
+                                            {"A3"_pos, "A3"_pos}}));
+}
+
+void TestChangeSubscription() {
+    Sheet sheet;
+    std::vector<std::vector<CellRange>> events;
+    const size_t subscription = sheet.Subscribe([&events](const std::vector<CellRange>& changed) {
+        events.push_back(changed);
+    });
+
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2");
+    sheet.SetCell("B1"_pos, "=A1");
+    events.clear();
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(events.size(), 1u);
+    ASSERT_EQUAL(events[0], (std::vector<CellRange>{{"A1"_pos, "B1"_pos}, {"A2"_pos, "A3"_pos}}));
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(events.size(), 1u);
+
+    sheet.BeginBatch();
+    sheet.SetCell("C5"_pos, "text");
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(events.size(), 1u);
+    sheet.EndBatch();
+    ASSERT_EQUAL(events.size(), 2u);
+    ASSERT_EQUAL(events[1], (std::vector<CellRange>{{"B1"_pos, "B1"_pos}, {"C5"_pos, "C5"_pos}}));
+
+    sheet.Unsubscribe(subscription);
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(events.size(), 2u);
+}
+
+void TestNumberInputs() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+B2");
+    sheet.SetCell("A2"_pos, "=A1*2");
+    sheet.SetCell("A3"_pos, "=B2");
+    sheet.SetNumber("B1"_pos, 1.5);
+    sheet.SetNumber("B2"_pos, 0.1);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.2));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(0.1));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "0.1");
+    ASSERT(sheet.GetNumber("B1"_pos) == 1.5);
+
+    std::vector<std::vector<CellRange>> events;
+    sheet.Subscribe([&events](const std::vector<CellRange>& changed) {
+        events.push_back(changed);
+    });
+    sheet.SetNumber("B1"_pos, 1.5);
+    ASSERT(events.empty());
+
+    // Nobody has read A1 or A3 since they became stale, so the waves stop there
+    sheet.SetNumbers({{"B1"_pos, 2.0}, {"B1"_pos, 3.0}, {"B2"_pos, 1e20}});
+    ASSERT_EQUAL(events.size(), 1u);
+    ASSERT_EQUAL(events[0], (std::vector<CellRange>{{"A1"_pos, "B2"_pos}}));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2e20));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1e20));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "1e+20");
+
+    sheet.SetNumber("B2"_pos, 1);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet.GetMemoryUsage().input_cells, 2u);
+
+    sheet.SetCell("B1"_pos, "=1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetMemoryUsage().input_cells, 1u);
+    sheet.SetNumber("B1"_pos, -1);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT(sheet.GetDependencies().GetPrecedents("B1"_pos).empty());
+
+    ASSERT_EQUAL(sheet.Freeze().GetCell("B1"_pos)->GetValue(), CellInterface::Value(-1.0));
+    ColumnarValues out;
+    sheet.ExportColumns({"B1"_pos, "B2"_pos}, out);
+    ASSERT(out.kinds == (std::vector{ColumnarValues::Kind::Number, ColumnarValues::Kind::Number}));
+    ASSERT_EQUAL(out.numbers, (std::vector{-1.0, 1.0}));
+}
+
+void TestNanThroughFormula() {
+    // NaN payloads that the cached formula value uses as internal markers
+    const auto make_nan = [](std::uint64_t bits) {
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    };
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=A1");
+    for (const std::uint64_t bits : {0x7ff4'0000'0000'0000u, 0x7ff5'0000'0000'0001u, 0x7ff8'0000'0000'0000u}) {
+        sheet.SetNumber("A1"_pos, make_nan(bits));
+        const auto value = sheet.GetCell("B1"_pos)->GetValue();
+        ASSERT(std::holds_alternative<double>(value) && std::isnan(std::get<double>(value)));
+        const auto last = sheet.GetLastValue("B1"_pos);
+        ASSERT(last && std::holds_alternative<double>(*last) && std::isnan(std::get<double>(*last)));
+    }
+
+    sheet.SetCell("A1"_pos, "nan");
+    const auto value = sheet.GetCell("B1"_pos)->GetValue();
+    ASSERT(std::holds_alternative<double>(value) && std::isnan(std::get<double>(value)));
+    sheet.SetCell("A1"_pos, "inf");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(std::numeric_limits<double>::infinity()));
+}
+
+void TestAsyncRecalc() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 3000; ++row) {
+        sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("B1"_pos, "=A3000*2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6000.0));
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT(sheet.GetLastValue("B1"_pos) == CellInterface::Value(6000.0));
+    sheet.SetCell("C1"_pos, "=A1");
+    ASSERT(!sheet.GetLastValue("C1"_pos));
+    ASSERT(sheet.GetLastValue("D1"_pos) == CellInterface::Value(""s));
+    ASSERT(sheet.GetLastValue("A1"_pos) == CellInterface::Value("2"s));
+
+    RecalcHandle recalc = sheet.RecalcAsync();
+    while (!recalc.IsDone()) {
+        const auto value = sheet.GetLastValue("A3000"_pos);
+        ASSERT(value == CellInterface::Value(3000.0) || value == CellInterface::Value(3001.0));
+    }
+    ASSERT(recalc.Wait());
+    ASSERT_EQUAL(recalc.GetProgress().evaluated, 3001u);
+    ASSERT_EQUAL(recalc.GetProgress().remaining, 0u);
+    ASSERT(sheet.GetLastValue("B1"_pos) == CellInterface::Value(6002.0));
+    ASSERT(sheet.GetLastValue("C1"_pos) == CellInterface::Value(2.0));
+
+    // An edit cancels the running recalc; whatever it left behind stays consistent
+    sheet.SetCell("A1"_pos, "3");
+    recalc = sheet.RecalcAsync();
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT(recalc.IsDone());
+    const auto progress = recalc.GetProgress();
+    ASSERT_EQUAL(progress.evaluated + progress.remaining, 3001u);
+    ASSERT(recalc.Wait() == (progress.remaining == 0));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6006.0));
+
+    sheet.SetCell("A1"_pos, "5");
+    recalc = sheet.RecalcAsync();
+    // Reads during the recalc return the last value without evaluating or waiting
+    const auto value = sheet.GetCell("A2000"_pos)->GetValue();
+    ASSERT(value == CellInterface::Value(2003.0) || value == CellInterface::Value(2004.0));
+    recalc.Cancel();
+    recalc.Wait();
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6008.0));
+    ASSERT(sheet.RecalcAsync().Wait());
+}
+
+void TestUnchangedCellText() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "= (A1 + 1) * 2");
+    sheet.SetCell("C1"_pos, "text");
+    size_t events = 0;
+    sheet.Subscribe([&events](const std::vector<CellRange>&) {
+        ++events;
+    });
+
+    sheet.SetCell("B1"_pos, "=(A1+1)*2");
+    sheet.SetCell("B1"_pos, "=( A1+1 )*2");
+    sheet.SetCell("B1"_pos, "=(A1+1)*2 ");
+    sheet.SetCell("C1"_pos, "text");
+    sheet.Import({{"B1"_pos, "=(A1 +1)*2"}, {"C1"_pos, "text"}});
+    ASSERT_EQUAL(events, 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=(A1+1)*2");
+
+    sheet.SetCell("B1"_pos, "=(A1+1)*3");
+    ASSERT_EQUAL(events, 1u);
+    sheet.SetCell("B1"_pos, "=(A11)*3");
+    ASSERT_EQUAL(events, 2u);
+    sheet.SetCell("C1"_pos, "text ");
+    ASSERT_EQUAL(events, 3u);
+    sheet.Import({{"C1"_pos, "text"}, {"C1"_pos, "text "}});
+    ASSERT_EQUAL(events, 3u);
+}
+
+void TestNumericColumns() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1.5");
+    sheet.SetCell("A2"_pos, "'2");
+    sheet.SetCell("A3"_pos, "3 ");
+    sheet.SetCell("A70"_pos, "70");
+    sheet.SetCell("B1"_pos, "=A1+A2+A70");
+
+    const auto& numbers = sheet.GetNumbers();
+    ASSERT_EQUAL(*numbers.Get("A1"_pos), 1.5);
+    ASSERT_EQUAL(*numbers.Get("A2"_pos), 2.0);
+    ASSERT(!numbers.Get("A3"_pos));
+    ASSERT(!numbers.Get("B1"_pos));
+    ASSERT(numbers.GetColumn(0)->IsValid(69));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(73.5));
+
+    sheet.SetCell("A70"_pos, "seventy");
+    ASSERT(!numbers.Get("A70"_pos));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(),
+                    CellInterface::Value(FormulaError::Category::Value));
+
+    sheet.ClearCell("A70"_pos);
+    sheet.SetCell("A1"_pos, "=1");
+    ASSERT(!numbers.Get("A1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    // One number at the bottom of a column costs one block, not the whole column
+    Sheet sparse;
+    const size_t empty_bytes = sparse.GetNumbers().GetMemoryUsage();
+    for (int col = 0; col < 100; ++col) {
+        sparse.SetNumber({Position::MAX_ROWS - 1, col}, col);
+    }
+    const size_t sparse_bytes = sparse.GetNumbers().GetMemoryUsage();
+    ASSERT(sparse_bytes < 100 * (sizeof(NumericColumns::Block) + 1024));
+    ASSERT_EQUAL(*sparse.GetNumbers().Get({Position::MAX_ROWS - 1, 42}), 42.0);
+    ASSERT(!sparse.GetNumbers().Get({Position::MAX_ROWS - 2, 42}));
+    for (int col = 0; col < 100; ++col) {
+        sparse.ClearCell({Position::MAX_ROWS - 1, col});
+    }
+    ASSERT(sparse.GetNumbers().GetMemoryUsage() - empty_bytes < 100 * 1024);
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.GetMemoryUsage().GetTotal(), 0u);
+
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "short");
+    sheet.SetCell("A3"_pos, "a text that does not fit into the string object");
+    sheet.SetCell("B1"_pos, "");
+    sheet.SetCell("B2"_pos, "=A1+A2");
+
+    const auto usage = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(usage.empty_cells, 1u);
+    ASSERT_EQUAL(usage.text_cells, 3u);
+    ASSERT_EQUAL(usage.formula_cells, 1u);
+    ASSERT(usage.text_bytes > 3 * usage.empty_bytes);
+    ASSERT(usage.formula_bytes > usage.empty_bytes);
+    ASSERT(usage.dependency_bytes > 0);
+    ASSERT_EQUAL(usage.GetTotal(), usage.empty_bytes + usage.text_bytes + usage.formula_bytes
+                                    + usage.dependency_bytes + usage.numeric_bytes);
+}
+
+void TestDependencyGraph() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    sheet.SetCell("D1"_pos, "=B1+C1");
+
+    auto sorted = [](std::vector<Position> positions) {
+        std::sort(positions.begin(), positions.end());
+        return positions;
+    };
+    const DependencyGraph& graph = sheet.GetDependencies();
+    ASSERT_EQUAL(sorted(graph.GetPrecedents("B1"_pos)), (std::vector{"A1"_pos, "A2"_pos}));
+    ASSERT_EQUAL(sorted(graph.GetDependents("B1"_pos)), (std::vector{"C1"_pos, "D1"_pos}));
+    ASSERT_EQUAL(sorted(graph.GetAllDependents("A2"_pos)),
+                 (std::vector{"B1"_pos, "C1"_pos, "D1"_pos}));
+    ASSERT_EQUAL(sorted(graph.GetAllPrecedents("D1"_pos)),
+                 (std::vector{"A1"_pos, "B1"_pos, "C1"_pos, "A2"_pos}));
+    ASSERT(graph.GetAllDependents("D1"_pos).empty());
+
+    sheet.SetCell("B1"_pos, "=A1");
+    ASSERT(graph.GetDependents("A2"_pos).empty());
+    sheet.ClearCell("C1"_pos);
+    ASSERT_EQUAL(graph.GetDependents("B1"_pos), std::vector{"D1"_pos});
+    ASSERT_EQUAL(sorted(graph.GetPrecedents("D1"_pos)), (std::vector{"B1"_pos, "C1"_pos}));
+    ASSERT_EQUAL(graph.GetNodeCount(), 4u);
+
+    // Многократная перезапись ссылок не раздувает граф
+    for (int i = 0; i < 10000; ++i) {
+        sheet.SetCell("E1"_pos, "=A" + std::to_string(i % 100 + 1) + "+B" + std::to_string(i % 7 + 1));
+    }
+    const size_t memory = graph.GetMemoryUsage();
+    for (int i = 0; i < 10000; ++i) {
+        sheet.SetCell("E1"_pos, "=A" + std::to_string(i % 100 + 1) + "+B" + std::to_string(i % 7 + 1));
+    }
+    ASSERT(graph.GetMemoryUsage() <= memory);
+    ASSERT_EQUAL(sorted(graph.GetPrecedents("E1"_pos)), (std::vector{"B4"_pos, "A100"_pos}));
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    // Повторяющиеся ссылки дают одно ребро
+    DependencyGraph chain;
+    std::vector<Position> repeated;
+    for (int i = 0; i < 20000; ++i) {
+        repeated.push_back(Position{i % 3, 0});
+    }
+    chain.SetPrecedents("B1"_pos, repeated);
+    ASSERT_EQUAL(sorted(chain.GetPrecedents("B1"_pos)), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
+    ASSERT_EQUAL(chain.GetDependents("A2"_pos), std::vector{"B1"_pos});
+
+    // Константные обходы из нескольких потоков одновременно
+    for (int row = 1; row < 1000; ++row) {
+        chain.SetPrecedents(Position{row, 2}, {Position{row - 1, 2}});
+    }
+    std::vector<std::thread> readers;
+    std::atomic<bool> consistent = true;
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&chain, &consistent]() {
+            for (int j = 0; j < 200; ++j) {
+                if (chain.GetAllDependents("C1"_pos).size() != 999u
+                    || chain.GetAllPrecedents(Position{999, 2}).size() != 999u) {
+                    consistent = false;
+                }
+            }
+        });
+    }
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    ASSERT(consistent);
+}
+
+void TestTraceQueries() {
+    Sheet sheet;
+    // Строка 1: A1..J1 ссылаются на A2..J2, которые ссылаются на A3, и т.д.
+    for (int row = 0; row < 5; ++row) {
+        for (int col = 0; col < 10; ++col) {
+            sheet.SetCell(Position{row, col}, row == 4 ? "1" : "=" + Position{row + 1, col}.ToString() + "+A5");
+        }
+    }
+
+    auto direct = sheet.TracePrecedents("C1"_pos, {1});
+    ASSERT_EQUAL(direct.cells.size(), 2u);
+    ASSERT(!direct.truncated);
+
+    auto all = sheet.TracePrecedents("C1"_pos);
+    ASSERT_EQUAL(all.cells.size(), 5u);
+    ASSERT_EQUAL(all.GetRanges(), (std::vector<CellRange>{{"C2"_pos, "C5"_pos}, {"A5"_pos, "A5"_pos}}));
+
+    auto dependents = sheet.TraceDependents("C5"_pos, {2});
+    ASSERT_EQUAL(dependents.GetRanges(), (std::vector<CellRange>{{"C3"_pos, "C4"_pos}}));
+    ASSERT_EQUAL(sheet.TraceDependents("A5"_pos).GetRanges(), (std::vector<CellRange>{{"A1"_pos, "J4"_pos}}));
+
+    auto capped = sheet.TraceDependents("A5"_pos, {INT_MAX, 10});
+    ASSERT_EQUAL(capped.cells.size(), 10u);
+    ASSERT(capped.truncated);
+    ASSERT(!sheet.TraceDependents("A5"_pos, {INT_MAX, 40}).truncated);
+
+    ASSERT(sheet.TraceDependents("Z99"_pos).cells.empty());
+    ASSERT(sheet.TracePrecedents("A1"_pos, {0}).cells.empty());
+}
+
+void TestCopyAndFill() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "'text");
+    sheet.SetCell("A2"_pos, "=A1+1");
+
+    sheet.FillRange({"A2"_pos, "A2"_pos}, {"A3"_pos, "A16000"_pos});
+    ASSERT_EQUAL(sheet.GetCell("A16000"_pos)->GetText(), "=A15999+1");
+    ASSERT_EQUAL(sheet.GetCell("A16000"_pos)->GetValue(), CellInterface::Value(16000.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{16000, 3}));
+
+    sheet.CopyRange({"B1"_pos, "C1"_pos}, "E3"_pos);
+    ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "=D3*2");
+    ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetText(), "'text");
+    sheet.SetCell("D3"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    // Ссылка левее столбца A
+    sheet.CopyRange({"B1"_pos, "B1"_pos}, "A5"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=#REF!*2");
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT(sheet.GetCell("A5"_pos)->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    // Copying the #REF! back does not revive the lost reference
+    sheet.SetCell("B8"_pos, "=A7");
+    sheet.CopyRange({"B8"_pos, "B8"_pos}, "A7"_pos);
+    ASSERT_EQUAL(sheet.GetCell("A7"_pos)->GetText(), "=#REF!");
+    sheet.CopyRange({"A7"_pos, "A7"_pos}, "B8"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B8"_pos)->GetText(), "=#REF!");
+    ASSERT(sheet.GetCell("B8"_pos)->GetReferencedCells().empty());
+
+    // Пустая ячейка источника очищает назначение
+    sheet.SetCell("H1"_pos, "x");
+    sheet.FillRange({"G1"_pos, "G1"_pos}, {"H1"_pos, "H2"_pos});
+    ASSERT(sheet.GetCell("H1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("H2"_pos) == nullptr);
+    // ...and removes it, so the printable area and memory shrink back
+    {
+        Sheet copy;
+        copy.SetCell("A1"_pos, "1");
+        copy.SetCell("B2"_pos, "=A1");
+        copy.SetCell("C3"_pos, "");
+        copy.SetCell("Z100"_pos, "far");
+        copy.SetCell("Y100"_pos, "=Z100");
+        copy.CopyRange({"X99"_pos, "Z100"_pos}, "X99"_pos);
+        ASSERT_EQUAL(copy.GetPrintableSize(), (Size{100, 26}));
+        copy.FillRange({"D1"_pos, "D1"_pos}, {"Y100"_pos, "Z100"_pos});
+        ASSERT_EQUAL(copy.GetPrintableSize(), (Size{3, 3}));
+        copy.CopyRange({"D1"_pos, "E3"_pos}, "B1"_pos);
+        ASSERT_EQUAL(copy.GetPrintableSize(), (Size{1, 1}));
+        const auto usage = copy.GetMemoryUsage();
+        ASSERT_EQUAL(usage.empty_cells + usage.text_cells + usage.formula_cells, 1u);
+    }
+
+    sheet.SetCell("J1"_pos, "=J3");
+    sheet.SetCell("J3"_pos, "=J2+1");
+    try {
+        sheet.CopyRange({"J3"_pos, "J3"_pos}, "J2"_pos);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet.GetCell("J2"_pos)->GetText().empty());
+    try {
+        sheet.CopyRange({"A1"_pos, "B1"_pos}, Position{0, Position::MAX_COLS - 1});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestImport() {
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=A1000*2");
+
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.push_back({"A1"_pos, "1"});
+    for (int row = 1; row < 1000; ++row) {
+        cells.push_back({Position{row, 0}, "=A" + std::to_string(row) + " + 1"});
+    }
+    cells.push_back({"C1"_pos, "text"});
+    cells.push_back({"C1"_pos, "=A1"});
+    sheet.Import(std::move(cells), 4);
+
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1000, 3}));
+    ASSERT_EQUAL(sheet.GetCell("A1000"_pos)->GetText(), "=A999+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2000.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    auto try_import = [&sheet](std::vector<std::pair<Position, std::string>> cells) {
+        try {
+            sheet.Import(std::move(cells));
+        } catch (const CircularDependencyException&) {
+            return "circular"s;
+        } catch (const FormulaException&) {
+            return "formula"s;
+        }
+        return "ok"s;
+    };
+    ASSERT_EQUAL(try_import({{"D1"_pos, "=D2"}, {"D2"_pos, "=B1"}, {"A1"_pos, "=D1"}}), "circular");
+    ASSERT_EQUAL(try_import({{"D1"_pos, "=1"}, {"D2"_pos, "=1+"}}), "formula");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1000, 3}));
+}
+
+void TestWorkerPool() {
+    // Pool threads outlive each run; several callers may share the pool
+    const auto run = [](WorkerPool& pool, size_t helpers) {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> sum{0};
+        pool.Run(helpers, [&next, &sum]() {
+            for (size_t i = next++; i < 10000; i = next++) {
+                sum += i;
+            }
+        });
+        return sum.load();
+    };
+    WorkerPool pool;
+    for (size_t round = 0; round < 100; ++round) {
+        ASSERT_EQUAL(run(pool, round % 4), 49995000u);
+    }
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 4; ++i) {
+        callers.emplace_back([&run, &pool]() {
+            for (int round = 0; round < 50; ++round) {
+                ASSERT_EQUAL(run(pool, 3), 49995000u);
+            }
+        });
+    }
+    for (auto& caller : callers) {
+        caller.join();
+    }
+}
+
+void TestExportColumns() {
+    Sheet sheet;
+    sheet.SetCell("B2"_pos, "2.5");
+    sheet.SetCell("B3"_pos, "'=text");
+    sheet.SetCell("C2"_pos, "=B2*2");
+    sheet.SetCell("C3"_pos, "=B3+1");
+    sheet.SetCell("D2"_pos, "word");
+    sheet.SetCell("D4"_pos, "=1/0");
+
+    ColumnarValues out;
+    sheet.ExportColumns({"B2"_pos, "D4"_pos}, out);
+    using Kind = ColumnarValues::Kind;
+    ASSERT_EQUAL(out.rows, 3);
+    ASSERT_EQUAL(out.cols, 3);
+    ASSERT(out.kinds == (std::vector{Kind::Text, Kind::Text, Kind::Empty,
+                                     Kind::Number, Kind::Error, Kind::Empty,
+                                     Kind::Text, Kind::Empty, Kind::Error}));
+    ASSERT_EQUAL(out.numbers[out.GetIndex(0, 0)], 2.5);
+    ASSERT_EQUAL(out.numbers[out.GetIndex(0, 1)], 5.0);
+    ASSERT(std::isnan(out.numbers[out.GetIndex(1, 0)]));
+    ASSERT(std::isnan(out.numbers[out.GetIndex(0, 2)]));
+    ASSERT(out.errors[out.GetIndex(1, 1)] == FormulaError::Category::Value);
+    ASSERT(out.errors[out.GetIndex(2, 2)] == FormulaError::Category::Arithmetic);
+    ASSERT_EQUAL(out.GetText(out.GetIndex(0, 0)), "2.5"sv);
+    ASSERT_EQUAL(out.GetText(out.GetIndex(1, 0)), "=text"sv);
+    ASSERT_EQUAL(out.GetText(out.GetIndex(0, 2)), "word"sv);
+    ASSERT_EQUAL(out.GetText(out.GetIndex(0, 1)), ""sv);
+    ASSERT_EQUAL(out.texts.size(), 12u);
+
+    // The same values whether cells are found through the table or the region
+    for (int row = 0; row < 20; ++row) {
+        sheet.SetCell({row + 10, 10}, std::to_string(row));
+    }
+    ColumnarValues wide;
+    sheet.ExportColumns({"A1"_pos, "Z100"_pos}, wide);
+    ASSERT_EQUAL(wide.numbers[wide.GetIndex(1, 2)], 5.0);
+    ASSERT_EQUAL(wide.numbers[wide.GetIndex(29, 10)], 19.0);
+    ASSERT_EQUAL(wide.GetText(wide.GetIndex(2, 1)), "=text"sv);
+    sheet.ExportColumns({"K11"_pos, "K11"_pos}, wide);
+    ASSERT_EQUAL(wide.numbers.size(), 1u);
+    ASSERT_EQUAL(wide.numbers[0], 0.0);
+}
+
+void TestFrozenSheet() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    sheet.SetCell("B2"_pos, "=A2+1");
+    sheet.SetCell("C3"_pos, "text");
+    sheet.SetCell("D1"_pos, "");
+
+    const FrozenSheet frozen = sheet.Freeze();
+    sheet.SetCell("A1"_pos, "3");
+
+    ASSERT_EQUAL(frozen.GetPrintableSize(), (Size{3, 4}));
+    ASSERT_EQUAL(frozen.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(frozen.GetCell("B1"_pos)->GetText(), "=A1*10");
+    ASSERT_EQUAL(frozen.GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+    ASSERT_EQUAL(frozen.GetCell("A2"_pos)->GetValue(), CellInterface::Value("=escaped"s));
+    ASSERT_EQUAL(frozen.GetCell("A2"_pos)->GetText(), "'=escaped");
+    ASSERT_EQUAL(frozen.GetCell("B1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(frozen.GetCell("D1"_pos)->GetText(), "");
+    ASSERT(frozen.GetCell("E1"_pos) == nullptr);
+    ASSERT(frozen.GetNumber("A1"_pos) == 2.0);
+    ASSERT(!frozen.GetNumber("C3"_pos));
+
+    std::ostringstream texts;
+    frozen.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "2\t=A1*10\t\t\n'=escaped\t=A2+1\t\t\n\t\ttext\t\n");
+    std::ostringstream values;
+    frozen.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "2\t20\t\t\n=escaped\t#VALUE!\t\t\n\t\ttext\t\n");
+
+    std::vector<double> sums(4);
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < sums.size(); ++i) {
+        readers.emplace_back([&frozen, &sum = sums[i]] {
+            const auto formula = ParseFormula("A1+B1");
+            for (int n = 0; n < 1000; ++n) {
+                sum += std::get<double>(formula->Evaluate(frozen));
+            }
+        });
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT(std::all_of(sums.begin(), sums.end(), [](double sum) { return sum == 22000.0; }));
+
+    FrozenSheet moved = sheet.Freeze();
+    ASSERT_EQUAL(moved.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+    try {
+        moved.SetCell("A1"_pos, "1");
+        ASSERT(false);
+    } catch (const ReadOnlySheetException&) {
+    }
+}
+
+void TestSheetSnapshots() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B2"_pos, "=A1+1");
+    sheet.SetCell("CA100"_pos, "far");
+    sheet.SetCell("CB101"_pos, "=A1*10");
+
+    const auto first = sheet.Snapshot();
+    ASSERT_EQUAL(first->GetVersion(), 1u);
+    ASSERT_EQUAL(first->GetTiles().size(), 2u);
+    ASSERT_EQUAL(sheet.Snapshot(), first);
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("C3"_pos, "text");
+    const auto second = sheet.Snapshot();
+    ASSERT_EQUAL(second->GetVersion(), 2u);
+    ASSERT_EQUAL(first->GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(second->GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(first->GetCell("CB101"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(second->GetCell("CB101"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT(first->GetCell("C3"_pos)->GetText().empty());
+    ASSERT_EQUAL(second->GetCell("C3"_pos)->GetText(), "text");
+    ASSERT(second->GetNumber("A1"_pos) == 2.0);
+
+    // A tile nothing changed in is shared by both versions
+    sheet.SetCell("D4"_pos, "4");
+    const auto third = sheet.Snapshot();
+    const auto far_tile = SheetSnapshot::GetTileKey("CA100"_pos);
+    ASSERT_EQUAL(third->GetTiles().at(far_tile), second->GetTiles().at(far_tile));
+    ASSERT(third->GetTiles().at(SheetSnapshot::GetTileKey("A1"_pos))
+           != second->GetTiles().at(SheetSnapshot::GetTileKey("A1"_pos)));
+
+    std::ostringstream live;
+    sheet.PrintValues(live);
+    std::ostringstream snapshot;
+    third->PrintValues(snapshot);
+    ASSERT_EQUAL(snapshot.str(), live.str());
+    live.str({});
+    snapshot.str({});
+    sheet.PrintTexts(live);
+    third->PrintTexts(snapshot);
+    ASSERT_EQUAL(snapshot.str(), live.str());
+
+    // Readers keep their version while the sheet is being edited
+    bool consistent = true;
+    std::thread reader([third, expected = snapshot.str(), &consistent]() {
+        for (int i = 0; i < 50; ++i) {
+            std::ostringstream out;
+            third->PrintTexts(out);
+            consistent = consistent && out.str() == expected
+                         && third->GetCell("CB101"_pos)->GetValue() == CellInterface::Value(20.0);
+        }
+    });
+    for (int i = 0; i < 50; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        sheet.Snapshot();
+    }
+    reader.join();
+    ASSERT(consistent);
+
+    sheet.ClearCell("CA100"_pos);
+    sheet.ClearCell("CB101"_pos);
+    const auto last = sheet.Snapshot();
+    ASSERT_EQUAL(last->GetTiles().count(far_tile), 0u);
+    ASSERT_EQUAL(last->GetPrintableSize(), (Size{4, 4}));
+    ASSERT(last->GetCell("CA100"_pos) == nullptr);
+    ASSERT(third->GetCell("CA100"_pos) != nullptr);
+
+    bool thrown = false;
+    try {
+        std::const_pointer_cast<SheetSnapshot>(last)->SetCell("A1"_pos, "1");
+    } catch (const ReadOnlySheetException&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void TestMappedSheet() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B2"_pos, "'=escaped");
+    sheet.SetCell("C3"_pos, "=A1*10");
+    sheet.SetCell("D4"_pos, "=B2+1");
+    sheet.SetCell(Position{100, 3}, "=A1+C3");
+    sheet.SetCell(Position{2, 200}, "far");
+
+    const std::string path = "mapped_sheet_test.bin";
+    sheet.Save(path);
+    {
+        MappedSheet mapped(path, 1);
+        ASSERT_EQUAL(mapped.GetPrintableSize(), sheet.GetPrintableSize());
+
+        std::ostringstream expected_values, values;
+        sheet.PrintValues(expected_values);
+        mapped.PrintValues(values);
+        ASSERT_EQUAL(values.str(), expected_values.str());
+        std::ostringstream expected_texts, texts;
+        sheet.PrintTexts(expected_texts);
+        mapped.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), expected_texts.str());
+
+        ASSERT_EQUAL(mapped.GetCell(Position{100, 3})->GetValue(), CellInterface::Value(22.0));
+        ASSERT_EQUAL(mapped.GetCell(Position{100, 3})->GetReferencedCells(),
+                     (std::vector{"A1"_pos, "C3"_pos}));
+        ASSERT_EQUAL(mapped.GetCell("D4"_pos)->GetValue(),
+                     CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(mapped.GetCell("B2"_pos)->GetValue(), CellInterface::Value("=escaped"s));
+        ASSERT_EQUAL(mapped.GetCell("B1"_pos)->GetText(), "");
+        ASSERT(mapped.GetCell(Position{101, 0}) == nullptr);
+        ASSERT(mapped.GetNumber("A1"_pos) == 2.0);
+        ASSERT_EQUAL(std::get<double>(ParseFormula("A1+C3+C4")->Evaluate(mapped)), 22.0);
+        ASSERT_EQUAL(mapped.GetCachedTiles(), 1u);
+
+        // Cells outlive the eviction of their tiles, also by other threads,
+        // until cached_tiles more tiles are evicted
+        const CellInterface* first = mapped.GetCell("C3"_pos);
+        std::thread([&mapped]() { mapped.GetCell(Position{2, 200}); }).join();
+        ASSERT(mapped.GetCell("C3"_pos) == first);
+        std::thread([&mapped]() { mapped.GetCell(Position{100, 3}); }).join();
+        ASSERT_EQUAL(first->GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(first->GetText(), "=A1*10");
+
+        try {
+            mapped.ClearCell("A1"_pos);
+            ASSERT(false);
+        } catch (const ReadOnlySheetException&) {
+        }
+    }
+
+    // Damaged files are rejected instead of being read out of bounds
+    std::string file;
+    {
+        std::ifstream in(path, std::ios::binary);
+        file.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    const auto expect_wrong = [&path](const std::string& damaged, Position pos) {
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out << damaged;
+        }
+        try {
+            MappedSheet mapped(path);
+            mapped.GetCell(pos);
+            ASSERT(false);
+        } catch (const std::runtime_error&) {
+        }
+    };
+    expect_wrong(file.substr(0, file.size() / 2), "A1"_pos);
+    expect_wrong(file.substr(0, 10), "A1"_pos);
+
+    // The header takes 24 bytes, then the first tile: a 4-byte count and the
+    // record of A1, which starts with its 16-bit row inside the tile
+    std::string damaged = file;
+    damaged[28] = damaged[29] = '\xff';
+    expect_wrong(damaged, "A1"_pos);
+    // The first directory entry: 8-byte offset, then 8-byte size
+    std::uint64_t directory;
+    std::memcpy(&directory, file.data() + 16, sizeof(directory));
+    damaged = file;
+    std::fill_n(damaged.begin() + directory + 8, 8, '\x7f');
+    expect_wrong(damaged, "A1"_pos);
+    damaged = file;
+    std::fill_n(damaged.begin() + directory, 8, '\x7f');
+    expect_wrong(damaged, "A1"_pos);
+    std::remove(path.c_str());
+}
+
+void TestDeepestDependencyChains() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("A4"_pos, "=A3*2");
+    sheet.SetCell("B1"_pos, "=C1");
+
+    const auto chains = sheet.GetDeepestChains(2);
+    ASSERT_EQUAL(chains.size(), 2u);
+    ASSERT_EQUAL(chains[0].last, "A4"_pos);
+    ASSERT_EQUAL(chains[0].first, "A1"_pos);
+    ASSERT_EQUAL(chains[0].length, 4);
+    ASSERT_EQUAL(chains[1].last, "A3"_pos);
+    ASSERT_EQUAL(chains[1].length, 3);
+}
+
+#ifdef SPREADSHEET_PROFILE
+void TestRecalcProfiler() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+1");
+
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.SetCell("A1"_pos, "2");
+
+    const auto& profiler = sheet.GetProfiler();
+    ASSERT_EQUAL(profiler.GetProfile("A3"_pos)->cache_hits, 1u);
+    ASSERT_EQUAL(profiler.GetProfile("A3"_pos)->cache_misses, 1u);
+    ASSERT_EQUAL(profiler.GetProfile("A2"_pos)->parses, 1u);
+    ASSERT_EQUAL(profiler.GetProfile("A1"_pos)->max_fan_out, 2u);
+
+    std::ostringstream report;
+    sheet.PrintProfile(report, 3);
+    ASSERT(report.str().find("A3\tA1\t3\n") != std::string::npos);
+}
+
+void TestRecalcProfilerDuringAsyncRecalc() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 3000; ++row) {
+        sheet.SetCell({row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    sheet.SetCell("B1"_pos, "=2");
+    sheet.GetCell("A3000"_pos)->GetValue();
+    sheet.GetCell("B1"_pos)->GetValue();
+    sheet.SetCell("A1"_pos, "2");
+    sheet.GetProfiler().Reset();
+
+    // Cache hits on this thread race with evaluations on the recalc thread,
+    // which add new cells to the statistics
+    RecalcHandle recalc = sheet.RecalcAsync();
+    std::uint64_t reads = 0;
+    while (!recalc.IsDone()) {
+        sheet.GetCell("B1"_pos)->GetValue();
+        sheet.GetCell("A3000"_pos)->GetValue();
+        ++reads;
+    }
+    ASSERT(recalc.Wait());
+
+    const auto& profiler = sheet.GetProfiler();
+    ASSERT_EQUAL(profiler.GetProfile("B1"_pos)->cache_hits, reads);
+    ASSERT_EQUAL(profiler.GetProfile("A3000"_pos)->cache_misses, 1u);
+    ASSERT_EQUAL(profiler.GetProfile("A2"_pos)->cache_misses, 1u);
+}
+#endif
 }  // namespace
 
 int main() {
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
+    RUN_TEST(tr, TestPositionChars);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
     RUN_TEST(tr, TestEmpty);
@@ -358,7 +1562,12 @@ int main() {
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
+    RUN_TEST(tr, TestFormulaConstantFolding);
+    RUN_TEST(tr, TestFormulaCache);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestConditionals);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestSpecializedShapes);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorArithmetic);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
@@ -367,4 +1576,29 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestFormulaParserReuse);
+    RUN_TEST(tr, TestLongReferenceChain);
+    RUN_TEST(tr, TestLongConditionalChain);
+    RUN_TEST(tr, TestCompressToRanges);
+    RUN_TEST(tr, TestChangeSubscription);
+    RUN_TEST(tr, TestUnchangedCellText);
+    RUN_TEST(tr, TestNanThroughFormula);
+    RUN_TEST(tr, TestAsyncRecalc);
+    RUN_TEST(tr, TestNumberInputs);
+    RUN_TEST(tr, TestNumericColumns);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestTraceQueries);
+    RUN_TEST(tr, TestCopyAndFill);
+    RUN_TEST(tr, TestImport);
+    RUN_TEST(tr, TestWorkerPool);
+    RUN_TEST(tr, TestExportColumns);
+    RUN_TEST(tr, TestFrozenSheet);
+    RUN_TEST(tr, TestMappedSheet);
+    RUN_TEST(tr, TestSheetSnapshots);
+    RUN_TEST(tr, TestDeepestDependencyChains);
+#ifdef SPREADSHEET_PROFILE
+    RUN_TEST(tr, TestRecalcProfiler);
+    RUN_TEST(tr, TestRecalcProfilerDuringAsyncRecalc);
+#endif
 }
\ No newline at end of file
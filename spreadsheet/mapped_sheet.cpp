@@ -0,0 +1,439 @@
+#include "mapped_sheet.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SPREADSHEET_HAS_MMAP
+#endif
+
+using namespace std::literals;
+
+// Формат файла (порядок байт - как у машины, которая его записала):
+//   заголовок: MAGIC, rows, cols, смещение каталога плиток
+//   плитки: число ячеек, затем записи ячеек в порядке позиций
+//   каталог: смещение и размер каждой плитки по строкам плиток, 0 - пусто
+// Запись ячейки: RecordHeader, текст, затем ссылки парами (row, col)
+namespace {
+    constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'M', 'A', 'P'};
+    constexpr int TILE_SIZE = 64;
+
+    enum class Kind : std::uint8_t {
+        Text,
+        Number,
+        Error,
+    };
+
+    struct FileHeader {
+        char magic[8];
+        std::int32_t rows;
+        std::int32_t cols;
+        std::uint64_t directory;
+    };
+
+    struct DirectoryEntry {
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    struct RecordHeader {
+        std::uint16_t row;
+        std::uint16_t col;
+        Kind kind;
+        // Значение текстовой ячейки - текст без первых value_offset символов
+        std::uint8_t value_offset;
+        std::uint8_t has_number;
+        std::uint8_t error;
+        double number;
+        std::uint32_t text_size;
+        std::uint32_t refs_count;
+    };
+
+    template <typename T>
+    T Load(const char* data){
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void Store(std::string& out, const T& value){
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    size_t GetRecordSize(const RecordHeader& header){
+        return sizeof(RecordHeader) + header.text_size + header.refs_count * 2 * sizeof(std::int32_t);
+    }
+
+    int TilesCount(int cells){
+        return (cells + TILE_SIZE - 1) / TILE_SIZE;
+    }
+
+    void AppendRecord(std::string& out, Position pos, const CellInterface& cell){
+        const std::string text = cell.GetText();
+        const std::vector<Position> refs = cell.GetReferencedCells();
+
+        RecordHeader header{};
+        header.row = static_cast<std::uint16_t>(pos.row % TILE_SIZE);
+        header.col = static_cast<std::uint16_t>(pos.col % TILE_SIZE);
+        const CellInterface::Value value = cell.GetValue();
+        if (const auto* number = std::get_if<double>(&value)){
+            header.kind = Kind::Number;
+            header.number = *number;
+        } else if (const auto* error = std::get_if<FormulaError>(&value)){
+            header.kind = Kind::Error;
+            header.error = static_cast<std::uint8_t>(error -> GetCategory());
+        } else {
+            header.kind = Kind::Text;
+            header.value_offset = static_cast<std::uint8_t>(text.size() - std::get<std::string>(value).size());
+            if (const auto number = ParseCellNumber(text)){
+                header.has_number = 1;
+                header.number = *number;
+            }
+        }
+        header.text_size = static_cast<std::uint32_t>(text.size());
+        header.refs_count = static_cast<std::uint32_t>(refs.size());
+
+        Store(out, header);
+        out += text;
+        for (const Position ref : refs){
+            Store(out, static_cast<std::int32_t>(ref.row));
+            Store(out, static_cast<std::int32_t>(ref.col));
+        }
+    }
+}
+
+void WriteMappedSheet(const std::string& path, Size size,
+                      const std::vector<std::pair<Position, const CellInterface*>>& cells){
+    const int tile_cols = TilesCount(size.cols);
+    const auto tile_of = [tile_cols](Position pos){
+        return static_cast<size_t>(pos.row / TILE_SIZE) * tile_cols + pos.col / TILE_SIZE;
+    };
+
+    std::vector<std::pair<Position, const CellInterface*>> sorted = cells;
+    std::sort(sorted.begin(), sorted.end(), [&tile_of](const auto& lhs, const auto& rhs){
+        const size_t lhs_tile = tile_of(lhs.first);
+        const size_t rhs_tile = tile_of(rhs.first);
+        return lhs_tile != rhs_tile ? lhs_tile < rhs_tile : lhs.first < rhs.first;
+    });
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out){
+        throw std::runtime_error("Can't create sheet file "s + path);
+    }
+    FileHeader header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.rows = size.rows;
+    header.cols = size.cols;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<DirectoryEntry> directory(static_cast<size_t>(TilesCount(size.rows)) * tile_cols);
+    std::uint64_t offset = sizeof(header);
+    std::string tile;
+    for (auto it = sorted.begin(); it != sorted.end();){
+        const size_t tile_number = tile_of(it -> first);
+        const auto tile_end = std::find_if(it, sorted.end(), [&](const auto& cell){
+            return tile_of(cell.first) != tile_number;
+        });
+
+        tile.clear();
+        Store(tile, static_cast<std::uint32_t>(tile_end - it));
+        for (; it != tile_end; ++it){
+            AppendRecord(tile, it -> first, *it -> second);
+        }
+        out.write(tile.data(), tile.size());
+        directory[tile_number] = {offset, tile.size()};
+        offset += tile.size();
+    }
+
+    header.directory = offset;
+    out.write(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(DirectoryEntry));
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!out){
+        throw std::runtime_error("Can't write sheet file "s + path);
+    }
+}
+
+MappedCell::MappedCell(const char* record)
+    : record_(record){
+}
+
+CellInterface::Value MappedCell::GetValue() const {
+    if (!record_){
+        return {};
+    }
+    const auto header = Load<RecordHeader>(record_);
+    switch (header.kind){
+        case Kind::Number:
+            return header.number;
+        case Kind::Error:
+            return FormulaError(static_cast<FormulaError::Category>(header.error));
+        default:
+            return std::string(record_ + sizeof(RecordHeader) + header.value_offset,
+                               header.text_size - header.value_offset);
+    }
+}
+
+std::string MappedCell::GetText() const {
+    if (!record_){
+        return {};
+    }
+    const auto header = Load<RecordHeader>(record_);
+    return std::string(record_ + sizeof(RecordHeader), header.text_size);
+}
+
+std::vector<Position> MappedCell::GetReferencedCells() const {
+    if (!record_){
+        return {};
+    }
+    const auto header = Load<RecordHeader>(record_);
+    const char* data = record_ + sizeof(RecordHeader) + header.text_size;
+    std::vector<Position> refs(header.refs_count);
+    for (auto& ref : refs){
+        ref.row = Load<std::int32_t>(data);
+        ref.col = Load<std::int32_t>(data + sizeof(std::int32_t));
+        data += 2 * sizeof(std::int32_t);
+    }
+    return refs;
+}
+
+std::optional<double> MappedCell::GetNumber() const {
+    if (!record_){
+        return std::nullopt;
+    }
+    const auto header = Load<RecordHeader>(record_);
+    if (header.kind != Kind::Text || !header.has_number){
+        return std::nullopt;
+    }
+    return header.number;
+}
+
+// Файл целиком, отображённый в память. Где mmap недоступен, файл читается
+class MappedSheet::MappedFile {
+public:
+    explicit MappedFile(const std::string& path){
+#ifdef SPREADSHEET_HAS_MMAP
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0){
+            throw std::runtime_error("Can't open sheet file "s + path);
+        }
+        struct stat info{};
+        if (fstat(fd, &info) == 0 && info.st_size > 0){
+            size_ = static_cast<size_t>(info.st_size);
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+            data_ = data != MAP_FAILED ? static_cast<const char*>(data) : nullptr;
+        }
+        close(fd);
+        if (!data_){
+            throw std::runtime_error("Can't map sheet file "s + path);
+        }
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in){
+            throw std::runtime_error("Can't open sheet file "s + path);
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
+
+    ~MappedFile(){
+#ifdef SPREADSHEET_HAS_MMAP
+        munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    const char* GetData() const {
+        return data_;
+    }
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifndef SPREADSHEET_HAS_MMAP
+    std::vector<char> buffer_;
+#endif
+};
+
+MappedSheet::MappedSheet(const std::string& path, size_t cached_tiles)
+    : file_(std::make_unique<MappedFile>(path))
+    , capacity_(std::max<size_t>(cached_tiles, 1)){
+    if (file_ -> GetSize() < sizeof(FileHeader)){
+        throw std::runtime_error("Wrong sheet file "s + path);
+    }
+    const auto header = Load<FileHeader>(file_ -> GetData());
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+            || header.rows < 0 || header.rows > Position::MAX_ROWS
+            || header.cols < 0 || header.cols > Position::MAX_COLS){
+        throw std::runtime_error("Wrong sheet file "s + path);
+    }
+    size_ = {header.rows, header.cols};
+    tile_cols_ = TilesCount(size_.cols);
+    const size_t directory_size = static_cast<size_t>(TilesCount(size_.rows)) * tile_cols_
+                                  * sizeof(DirectoryEntry);
+    // Сравнение без сложения: смещение каталога прочитано из файла и может
+    // быть любым
+    if (header.directory < sizeof(FileHeader) || header.directory > file_ -> GetSize()
+            || file_ -> GetSize() - header.directory != directory_size){
+        throw std::runtime_error("Wrong sheet file "s + path);
+    }
+    directory_ = file_ -> GetData() + header.directory;
+}
+
+MappedSheet::~MappedSheet() = default;
+
+void MappedSheet::SetCell(Position, std::string){
+    throw ReadOnlySheetException{"Mapped sheet can't be changed"s};
+}
+
+void MappedSheet::ClearCell(Position){
+    throw ReadOnlySheetException{"Mapped sheet can't be changed"s};
+}
+
+std::unique_ptr<MappedSheet::Tile> MappedSheet::LoadTile(size_t tile) const {
+    auto result = std::make_unique<Tile>();
+    const auto entry = Load<DirectoryEntry>(directory_ + tile * sizeof(DirectoryEntry));
+    if (entry.size == 0){
+        return result;
+    }
+    // Плитка должна лежать между заголовком и каталогом, а записи - целиком
+    // внутри плитки. Иначе файл повреждён, и чтение вышло бы за его пределы
+    const auto wrong_tile = [tile](){
+        return std::runtime_error("Wrong sheet file tile "s + std::to_string(tile));
+    };
+    const size_t tiles_end = directory_ - file_ -> GetData();
+    if (entry.offset < sizeof(FileHeader) || entry.offset > tiles_end
+            || entry.size > tiles_end - entry.offset || entry.size < sizeof(std::uint32_t)){
+        throw wrong_tile();
+    }
+    const char* data = file_ -> GetData() + entry.offset;
+    const char* const end = data + entry.size;
+    const auto count = Load<std::uint32_t>(data);
+    data += sizeof(std::uint32_t);
+    if (count > TILE_SIZE * TILE_SIZE){
+        throw wrong_tile();
+    }
+
+    result -> cells.reserve(count);
+    result -> index.assign(TILE_SIZE * TILE_SIZE, 0);
+    for (std::uint32_t i = 0; i < count; ++i){
+        if (static_cast<size_t>(end - data) < sizeof(RecordHeader)){
+            throw wrong_tile();
+        }
+        const auto header = Load<RecordHeader>(data);
+        if (header.row >= TILE_SIZE || header.col >= TILE_SIZE || header.kind > Kind::Error
+                || header.value_offset > header.text_size
+                || GetRecordSize(header) > static_cast<size_t>(end - data)){
+            throw wrong_tile();
+        }
+        result -> cells.emplace_back(data);
+        result -> index[header.row * TILE_SIZE + header.col] = static_cast<std::uint16_t>(i + 1);
+        data += GetRecordSize(header);
+    }
+    return result;
+}
+
+const MappedSheet::Tile& MappedSheet::GetTile(size_t tile) const {
+    if (const auto it = index_.find(tile); it != index_.end()){
+        auto& from = it -> second -> retired ? retired_ : tiles_;
+        tiles_.splice(tiles_.begin(), from, it -> second);
+        it -> second -> retired = false;
+    } else {
+        tiles_.push_front({tile, false, LoadTile(tile)});
+        index_[tile] = tiles_.begin();
+    }
+    while (tiles_.size() > capacity_){
+        tiles_.back().retired = true;
+        retired_.splice(retired_.begin(), tiles_, std::prev(tiles_.end()));
+    }
+    while (retired_.size() > capacity_){
+        index_.erase(retired_.back().number);
+        retired_.pop_back();
+    }
+    return *tiles_.front().tile;
+}
+
+const MappedCell* MappedSheet::FindCell(Position pos) const {
+    if (pos.row >= size_.rows || pos.col >= size_.cols){
+        return nullptr;
+    }
+    const Tile& tile = GetTile(static_cast<size_t>(pos.row / TILE_SIZE) * tile_cols_ + pos.col / TILE_SIZE);
+    if (tile.cells.empty()){
+        return nullptr;
+    }
+    const std::uint16_t number = tile.index[pos.row % TILE_SIZE * TILE_SIZE + pos.col % TILE_SIZE];
+    return number != 0 ? &tile.cells[number - 1] : nullptr;
+}
+
+const CellInterface* MappedSheet::GetCell(Position pos) const {
+    if (!pos.IsValid()){
+        throw InvalidPositionException{"Wrong cell position, out of table"s};
+    }
+    std::lock_guard guard(mutex_);
+    if (const MappedCell* cell = FindCell(pos)){
+        return cell;
+    }
+    return pos.col < size_.cols && pos.row < size_.rows ? &empty_cell_ : nullptr;
+}
+
+CellInterface* MappedSheet::GetCell(Position pos){
+    // У MappedCell нет изменяющих методов, отдавать её без const безопасно
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+Size MappedSheet::GetPrintableSize() const {
+    return size_;
+}
+
+void MappedSheet::PrintValues(std::ostream& out) const {
+    for (int row = 0; row < size_.rows; ++row){
+        for (int col = 0; col < size_.cols; ++col){
+            if (std::lock_guard guard(mutex_); const MappedCell* cell = FindCell({row, col})){
+                std::visit([&out](auto&& element){out << element;}, cell -> GetValue());
+            }
+            if (col < size_.cols - 1){
+                out << '\t';
+            }
+        }
+        out << '\n';
+    }
+}
+
+void MappedSheet::PrintTexts(std::ostream& out) const {
+    for (int row = 0; row < size_.rows; ++row){
+        for (int col = 0; col < size_.cols; ++col){
+            if (std::lock_guard guard(mutex_); const MappedCell* cell = FindCell({row, col})){
+                out << cell -> GetText();
+            }
+            if (col < size_.cols - 1){
+                out << '\t';
+            }
+        }
+        out << '\n';
+    }
+}
+
+std::optional<double> MappedSheet::GetNumber(Position pos) const {
+    std::lock_guard guard(mutex_);
+    const MappedCell* cell = FindCell(pos);
+    return cell ? cell -> GetNumber() : std::nullopt;
+}
+
+size_t MappedSheet::GetCachedTiles() const {
+    std::lock_guard guard(mutex_);
+    return tiles_.size();
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "common.h"
+#include "frozen_sheet.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Записывает посчитанные значения и тексты cells в файл для MappedSheet.
+// Ячейки группируются в квадратные плитки, каждая плитка пишется одним куском
+void WriteMappedSheet(const std::string& path, Size size,
+                      const std::vector<std::pair<Position, const CellInterface*>>& cells);
+
+// Ячейка, которая читает значение и текст прямо из отображённого файла
+class MappedCell : public CellInterface {
+public:
+    MappedCell() = default;
+    explicit MappedCell(const char* record);
+
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+    std::optional<double> GetNumber() const;
+
+private:
+    // nullptr у пустой ячейки
+    const char* record_ = nullptr;
+};
+
+// Таблица только для чтения, которая лежит в файле WriteMappedSheet.
+// Файл отображается в память, поэтому в оперативной памяти оказываются лишь
+// страницы, к которым обращались. Разобранные плитки (индекс позиций и
+// записей) хранятся в кэше на cached_tiles плиток, давно не использованные
+// вытесняются.
+// Ячейки, отданные GetCell, хранятся в своих плитках. Вытесненная плитка
+// живёт, пока из кэша не вытеснены ещё cached_tiles плиток, и при
+// обращении возвращается в кэш с теми же ячейками. Поэтому указатель из
+// GetCell действителен, пока после последнего обращения к его плитке
+// разобрано меньше cached_tiles других плиток.
+// Изменение таблицы бросает ReadOnlySheetException, повреждённый файл -
+// std::runtime_error при открытии или при чтении повреждённой плитки.
+class MappedSheet : public SheetInterface {
+public:
+    explicit MappedSheet(const std::string& path, size_t cached_tiles = 64);
+    ~MappedSheet();
+
+    MappedSheet(const MappedSheet&) = delete;
+    MappedSheet& operator=(const MappedSheet&) = delete;
+
+    void SetCell(Position pos, std::string text) override;
+    void ClearCell(Position pos) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& out) const override;
+    void PrintTexts(std::ostream& out) const override;
+
+    std::optional<double> GetNumber(Position pos) const override;
+
+    // Сколько плиток сейчас разобрано в памяти
+    size_t GetCachedTiles() const;
+
+private:
+    class MappedFile;
+
+    struct Tile {
+        // Ячейки записей в отображённом файле
+        std::vector<MappedCell> cells;
+        // Номер ячейки в cells плюс один для каждой позиции плитки, 0 - пусто
+        std::vector<std::uint16_t> index;
+    };
+
+    struct CachedTile {
+        size_t number;
+        // Плитка вытеснена из кэша, но её ячейки ещё могут быть в ходу
+        bool retired;
+        std::unique_ptr<Tile> tile;
+    };
+
+    // Ячейка или nullptr. Вызывается под mutex_
+    const MappedCell* FindCell(Position pos) const;
+    const Tile& GetTile(size_t tile) const;
+    std::unique_ptr<Tile> LoadTile(size_t tile) const;
+
+    std::unique_ptr<MappedFile> file_;
+    Size size_;
+    int tile_cols_ = 0;
+    const char* directory_ = nullptr;
+    MappedCell empty_cell_;
+
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    // Оба списка - от недавно использованных к давно использованным.
+    // Плитки переходят между ними через splice, поэтому итераторы в index_
+    // остаются действительными
+    mutable std::list<CachedTile> tiles_;
+    mutable std::list<CachedTile> retired_;
+    mutable std::unordered_map<size_t, std::list<CachedTile>::iterator> index_;
+};
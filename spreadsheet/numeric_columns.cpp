@@ -0,0 +1,86 @@
+#include "numeric_columns.h"
+
+namespace {
+    constexpr int WORD_BITS = 64;
+
+    std::uint64_t GetBit(int row){
+        return std::uint64_t{1} << (row % WORD_BITS);
+    }
+
+    std::uint64_t& GetWord(NumericColumns::Block& block, int row){
+        return block.valid[row % NumericColumns::BLOCK_ROWS / WORD_BITS];
+    }
+}
+
+bool NumericColumns::Column::IsValid(int row) const {
+    const size_t block = row / BLOCK_ROWS;
+    return block < blocks.size() && blocks[block]
+        && (blocks[block] -> valid[row % BLOCK_ROWS / WORD_BITS] & GetBit(row)) != 0;
+}
+
+double NumericColumns::Column::GetValue(int row) const {
+    return blocks[row / BLOCK_ROWS] -> values[row % BLOCK_ROWS];
+}
+
+void NumericColumns::Set(Position pos, double value){
+    if (static_cast<size_t>(pos.col) >= columns_.size()){
+        columns_.resize(pos.col + 1);
+    }
+    Column& column = columns_[pos.col];
+    const size_t block_number = pos.row / BLOCK_ROWS;
+    if (block_number >= column.blocks.size()){
+        column.blocks.resize(block_number + 1);
+    }
+    auto& block = column.blocks[block_number];
+    if (!block){
+        block = std::make_unique<Block>();
+    }
+    block -> values[pos.row % BLOCK_ROWS] = value;
+    std::uint64_t& word = GetWord(*block, pos.row);
+    if ((word & GetBit(pos.row)) == 0){
+        word |= GetBit(pos.row);
+        ++block -> count;
+    }
+}
+
+void NumericColumns::Reset(Position pos){
+    if (static_cast<size_t>(pos.col) >= columns_.size()){
+        return;
+    }
+    Column& column = columns_[pos.col];
+    const size_t block_number = pos.row / BLOCK_ROWS;
+    if (block_number >= column.blocks.size() || !column.blocks[block_number]){
+        return;
+    }
+    auto& block = column.blocks[block_number];
+    std::uint64_t& word = GetWord(*block, pos.row);
+    if ((word & GetBit(pos.row)) != 0){
+        word &= ~GetBit(pos.row);
+        if (--block -> count == 0){
+            block.reset();
+        }
+    }
+}
+
+std::optional<double> NumericColumns::Get(Position pos) const {
+    const Column* column = GetColumn(pos.col);
+    if (column && column -> IsValid(pos.row)){
+        return column -> GetValue(pos.row);
+    }
+    return std::nullopt;
+}
+
+const NumericColumns::Column* NumericColumns::GetColumn(int col) const {
+    return static_cast<size_t>(col) < columns_.size() ? &columns_[col] : nullptr;
+}
+
+size_t NumericColumns::GetMemoryUsage() const {
+    size_t bytes = columns_.capacity() * sizeof(Column);
+    for (const auto& column : columns_){
+        bytes += column.blocks.capacity() * sizeof(std::unique_ptr<Block>);
+        for (const auto& block : column.blocks){
+            bytes += block ? sizeof(Block) : 0;
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Числовые значения текстовых и входных ячеек, разложенные по столбцам в
+// блоки по BLOCK_ROWS строк. Позволяет читать числа без разбора строк и без
+// поиска в хеш-таблице ячеек. Память выделяется только под блоки, в которых
+// есть числа, поэтому одно число в конце столбца стоит одного блока, а не
+// массива на всю высоту столбца.
+class NumericColumns {
+public:
+    static constexpr int BLOCK_ROWS = 256;
+
+    struct Block {
+        // values[i] имеет смысл, только если установлен бит i в valid
+        std::array<double, BLOCK_ROWS> values;
+        std::array<std::uint64_t, BLOCK_ROWS / 64> valid{};
+        // Сколько битов установлено в valid; пустой блок освобождается
+        int count = 0;
+    };
+
+    struct Column {
+        // Блок строк [i * BLOCK_ROWS, (i + 1) * BLOCK_ROWS) или nullptr
+        std::vector<std::unique_ptr<Block>> blocks;
+
+        bool IsValid(int row) const;
+        // Только для строк, где IsValid
+        double GetValue(int row) const;
+    };
+
+    void Set(Position pos, double value);
+    void Reset(Position pos);
+
+    std::optional<double> Get(Position pos) const;
+
+    // nullptr, если в столбце ещё не было чисел
+    const Column* GetColumn(int col) const;
+
+    size_t GetMemoryUsage() const;
+
+private:
+    std::vector<Column> columns_;
+};
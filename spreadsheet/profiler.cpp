@@ -0,0 +1,119 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <ostream>
+
+namespace {
+    // Самый вложенный незавершённый замер вычисления в этом потоке
+    thread_local RecalcProfiler::EvaluationScope* current_evaluation = nullptr;
+}  // namespace
+
+// class RecalcProfiler::EvaluationScope
+
+RecalcProfiler::EvaluationScope::EvaluationScope(RecalcProfiler& profiler, Position pos)
+    : profiler_(profiler)
+    , pos_(pos)
+    , start_(Clock::now())
+    , parent_(current_evaluation)
+{
+    {
+        std::lock_guard guard(profiler_.mutex_);
+        ++profiler_.profiles_[pos_].cache_misses;
+    }
+    current_evaluation = this;
+}
+
+RecalcProfiler::EvaluationScope::~EvaluationScope(){
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_);
+    current_evaluation = parent_;
+    if (parent_){
+        parent_ -> children_time_ += elapsed;
+    }
+
+    std::lock_guard guard(profiler_.mutex_);
+    auto& profile = profiler_.profiles_[pos_];
+    profile.eval_time += elapsed;
+    profile.self_eval_time += elapsed - children_time_;
+}
+
+// class RecalcProfiler::ParseScope
+
+RecalcProfiler::ParseScope::ParseScope(RecalcProfiler& profiler, Position pos)
+    : profiler_(profiler)
+    , pos_(pos)
+    , start_(Clock::now())
+{
+}
+
+RecalcProfiler::ParseScope::~ParseScope(){
+    std::lock_guard guard(profiler_.mutex_);
+    auto& profile = profiler_.profiles_[pos_];
+    ++profile.parses;
+    profile.parse_time += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_);
+}
+
+// class RecalcProfiler
+
+void RecalcProfiler::CountHit(Position pos){
+    std::lock_guard guard(mutex_);
+    ++profiles_[pos].cache_hits;
+}
+
+void RecalcProfiler::BeginInvalidation(Position pos){
+    invalidation_root_ = pos;
+    fan_out_ = 0;
+}
+
+void RecalcProfiler::CountInvalidated(){
+    ++fan_out_;
+}
+
+void RecalcProfiler::EndInvalidation(){
+    std::lock_guard guard(mutex_);
+    auto& profile = profiles_[invalidation_root_];
+    ++profile.invalidations;
+    profile.invalidated_cells += fan_out_;
+    profile.max_fan_out = std::max(profile.max_fan_out, fan_out_);
+    invalidation_root_ = Position::NONE;
+}
+
+std::optional<CellProfile> RecalcProfiler::GetProfile(Position pos) const {
+    std::lock_guard guard(mutex_);
+    const auto it = profiles_.find(pos);
+    return it != profiles_.end() ? std::optional<CellProfile>(it -> second) : std::nullopt;
+}
+
+std::vector<std::pair<Position, CellProfile>> RecalcProfiler::GetMostExpensive(size_t count) const {
+    std::unique_lock lock(mutex_);
+    std::vector<std::pair<Position, CellProfile>> result(profiles_.begin(), profiles_.end());
+    lock.unlock();
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(),
+        [](const auto& lhs, const auto& rhs){
+            return lhs.second.self_eval_time > rhs.second.self_eval_time;
+        });
+    result.resize(count);
+    return result;
+}
+
+void RecalcProfiler::PrintReport(std::ostream& out, size_t count) const {
+    out << "cell\tself_ns\ttotal_ns\thits\tmisses\tparses\tparse_ns\tinvalidations\tmax_fan_out\n";
+    for (const auto& [pos, profile] : GetMostExpensive(count)){
+        out << pos.ToString() << '\t'
+            << profile.self_eval_time.count() << '\t'
+            << profile.eval_time.count() << '\t'
+            << profile.cache_hits << '\t'
+            << profile.cache_misses << '\t'
+            << profile.parses << '\t'
+            << profile.parse_time.count() << '\t'
+            << profile.invalidations << '\t'
+            << profile.max_fan_out << '\n';
+    }
+}
+
+void RecalcProfiler::Reset(){
+    std::lock_guard guard(mutex_);
+    profiles_.clear();
+    invalidation_root_ = Position::NONE;
+    fan_out_ = 0;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Сборка с -DSPREADSHEET_PROFILE (опция CMake SPREADSHEET_PROFILE) включает
+// сбор статистики пересчёта. Без флага обращения к профилировщику вырезаются
+// препроцессором и ничего не стоят.
+#ifdef SPREADSHEET_PROFILE
+#define SHEET_PROFILE(statement) statement
+#else
+#define SHEET_PROFILE(statement)
+#endif
+
+struct CellProfile {
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    // Время вычисления вместе с вычислением ячеек, на которые ссылается формула
+    std::chrono::nanoseconds eval_time{0};
+    // Время вычисления без учёта ячеек, на которые ссылается формула
+    std::chrono::nanoseconds self_eval_time{0};
+    std::uint64_t parses = 0;
+    std::chrono::nanoseconds parse_time{0};
+    // Сколько раз изменение ячейки сбрасывало кеш зависимых ячеек и сколько ячеек сброшено
+    std::uint64_t invalidations = 0;
+    std::uint64_t invalidated_cells = 0;
+    std::uint64_t max_fan_out = 0;
+};
+
+// Статистику могут одновременно пополнять фоновый пересчёт и потоки,
+// читающие значения, поэтому она меняется под mutex_
+class RecalcProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Замеряет вычисление значения ячейки, которого не было в кеше.
+    // Вложенные замеры своего потока образуют стек через parent_
+    class EvaluationScope {
+    public:
+        EvaluationScope(RecalcProfiler& profiler, Position pos);
+        ~EvaluationScope();
+
+        EvaluationScope(const EvaluationScope&) = delete;
+        EvaluationScope& operator=(const EvaluationScope&) = delete;
+    private:
+        RecalcProfiler& profiler_;
+        Position pos_;
+        Clock::time_point start_;
+        EvaluationScope* parent_;
+        // Время вложенных вычислений
+        std::chrono::nanoseconds children_time_{0};
+    };
+
+    // Замеряет разбор формулы
+    class ParseScope {
+    public:
+        ParseScope(RecalcProfiler& profiler, Position pos);
+        ~ParseScope();
+
+        ParseScope(const ParseScope&) = delete;
+        ParseScope& operator=(const ParseScope&) = delete;
+    private:
+        RecalcProfiler& profiler_;
+        Position pos_;
+        Clock::time_point start_;
+    };
+
+    void CountHit(Position pos);
+
+    void BeginInvalidation(Position pos);
+    void CountInvalidated();
+    void EndInvalidation();
+
+    // nullopt, если по ячейке ещё нет статистики
+    std::optional<CellProfile> GetProfile(Position pos) const;
+
+    // Ячейки с наибольшим собственным временем вычисления, по убыванию
+    std::vector<std::pair<Position, CellProfile>> GetMostExpensive(size_t count) const;
+
+    // Печатает GetMostExpensive(count) в виде таблицы с разделителями-табуляциями
+    void PrintReport(std::ostream& out, size_t count) const;
+
+    void Reset();
+
+private:
+    mutable std::mutex mutex_;
+    std::unordered_map<Position, CellProfile, PositionHash> profiles_;
+    // Сброс кешей идёт только при правке таблицы, а она отменяет пересчёт
+    Position invalidation_root_ = Position::NONE;
+    std::uint64_t fan_out_ = 0;
+};
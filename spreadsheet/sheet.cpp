@@ -2,26 +2,144 @@
 
 #include "cell.h"
 #include "common.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <exception>
+#include <iterator>
+#include <ostream>
+#include <thread>
 
 using namespace std::literals;
 
+namespace {
+    bool IsFormulaText(const std::string& text){
+        return text[0] == FORMULA_SIGN && text.size() > 1;
+    }
+
+    // Столько ячеек фоновый пересчёт вычисляет под одной блокировкой
+    constexpr size_t RECALC_STEP = 64;
 
-Sheet::~Sheet() = default;
+    // На меньшее число формул не стоит будить ещё один поток разбора
+    constexpr size_t PARSE_FORMULAS_PER_THREAD = 256;
 
-void Sheet::InvalidCachePos(Position pos){
-    if (depended_cells_.count(pos) != 0){
-        InvalidateCache(depended_cells_.at(pos));
+    // Добавляет к cells ячейки областей ranges, для которых keep(Position) истинно
+    template <typename Filter>
+    void AppendRangeCells(const std::vector<CellRange>& ranges, Filter keep, std::vector<Position>& cells){
+        for (const CellRange& range : ranges){
+            for (int row = range.first.row; row <= range.last.row; ++row){
+                for (int col = range.first.col; col <= range.last.col; ++col){
+                    if (keep(Position{row, col})){
+                        cells.push_back({row, col});
+                    }
+                }
+            }
+        }
     }
 }
 
-void Sheet::InvalidateCache(const DependedCells& depended_cells){
-    for (auto pos : depended_cells){
-        if (table_.count(pos) != 0){
-            table_[pos] -> ResetCache();
+RecalcHandle::RecalcHandle(std::shared_ptr<State> state)
+    : state_(std::move(state)){
+}
+
+RecalcHandle::Progress RecalcHandle::GetProgress() const {
+    const size_t evaluated = state_ -> evaluated;
+    return {evaluated, state_ -> order.size() - evaluated};
+}
+
+bool RecalcHandle::IsDone() const {
+    return state_ -> finished.wait_for(0s) == std::future_status::ready;
+}
+
+bool RecalcHandle::Wait() const {
+    return state_ -> finished.get();
+}
+
+void RecalcHandle::Cancel(){
+    state_ -> cancelled = true;
+}
+
+
+Sheet::~Sheet(){
+    CancelRecalc();
+}
+
+void Sheet::InvalidCachePos(Position pos){
+    SHEET_PROFILE(profiler_.BeginInvalidation(pos));
+    NotifyChanged(pos);
+    dependencies_.VisitDependents(pos, [this](Position depended){
+        NotifyChanged(depended);
+        if (const auto it = table_.find(depended); it != table_.end()){
+            it -> second.ResetCache();
+            SHEET_PROFILE(profiler_.CountInvalidated());
+        }
+        return true;
+    });
+    SHEET_PROFILE(profiler_.EndInvalidation());
+}
+
+void Sheet::InvalidInputPos(Position pos){
+    SHEET_PROFILE(profiler_.BeginInvalidation(pos));
+    NotifyChanged(pos);
+    dependencies_.VisitDependents(pos, [this](Position depended){
+        const auto it = table_.find(depended);
+        if (it == table_.end()){
+            return true;
         }
-        depended_cells_.count(pos) != 0
-                ? InvalidateCache(depended_cells_[pos]) : InvalidateCache({});
+        if (const FormulaImpl* formula = it -> second.GetFormula(); formula && formula -> NeedsEvaluation()){
+            return false;
+        }
+        NotifyChanged(depended);
+        it -> second.ResetCache();
+        SHEET_PROFILE(profiler_.CountInvalidated());
+        return true;
+    });
+    SHEET_PROFILE(profiler_.EndInvalidation());
+}
+
+const Cell* Sheet::FindCell(Position pos) const {
+    const auto it = table_.find(pos);
+    return it != table_.end() ? &it -> second : nullptr;
+}
+
+void Sheet::CheckCircularDependency(Position cell, const std::vector<Position>& reff_cells,
+                                    const std::vector<CellRange>& reff_ranges) const {
+    // Цикл появится, если одна из ячеек reff_cells или областей reff_ranges уже
+    // зависит от cell. Обходятся зависимые ячейки: при заполнении таблицы
+    // сверху вниз их обычно немного
+    const std::unordered_set<Position, PositionHash> targets(reff_cells.begin(), reff_cells.end());
+    const auto is_target = [&targets, &reff_ranges](Position pos){
+        return targets.count(pos) != 0 || std::any_of(reff_ranges.begin(), reff_ranges.end(),
+            [pos](CellRange range){
+                return range.Contains(pos);
+            });
+    };
+    if (is_target(cell)){
+        throw CircularDependencyException{"Wrong formula with circular"s};
     }
+    dependencies_.VisitDependents(cell, [&is_target](Position depended){
+        if (is_target(depended)){
+            throw CircularDependencyException{"Wrong formula with circular"s};
+        }
+        return true;
+    });
+}
+
+const DependencyGraph& Sheet::GetDependencies() const {
+    return dependencies_;
+}
+
+DependencyGraph::Trace Sheet::TracePrecedents(Position pos, DependencyGraph::TraceLimits limits) const {
+    CheckPosValidation(pos);
+    return dependencies_.TracePrecedents(pos, limits);
+}
+
+DependencyGraph::Trace Sheet::TraceDependents(Position pos, DependencyGraph::TraceLimits limits) const {
+    CheckPosValidation(pos);
+    return dependencies_.TraceDependents(pos, limits);
 }
 
 void Sheet::CheckPosValidation(Position pos) const {
@@ -30,67 +148,315 @@ void Sheet::CheckPosValidation(Position pos) const {
     }
 }
 
-void Sheet::RemoveOldDependedCells(Position cell, const std::vector<Position>& cells){
-    for (auto pos : cells){
-        if (depended_cells_.count(pos) != 0) {
-            depended_cells_[pos].erase(cell);
-        }
+Cell Sheet::CreateCell(Position pos, std::string text) const {
+    Cell cell;
+    if (IsFormulaText(text)){
+        SHEET_PROFILE(RecalcProfiler::ParseScope scope(profiler_, pos));
+        auto formula = std::make_unique<FormulaImpl>(ParseFormula(text.substr(1)), *this, pos);
+        CheckCircularDependency(pos, formula -> GetReferencedCells(), formula -> GetReferencedRanges());
+        cell.SetFormula(std::move(formula));
+    } else {
+        cell.SetText(std::move(text));
     }
+    return cell;
 }
 
-void Sheet::AddNewDependedCells(Position cell, const std::vector<Position>& cells){
-    for (const auto& pos : cells){
-        depended_cells_[pos].insert(cell);
-    }
+void Sheet::ReplaceCell(Position pos, Cell cell){
+    CancelRecalc();
+    Cell& target = table_[pos];
+    target = std::move(cell);
+    UpdateNumber(pos, target);
+    InvalidCachePos(pos);
+
+    dependencies_.SetPrecedents(pos, target.GetReferencedCells(), target.GetReferencedRanges());
 }
 
-bool Sheet::SuccessSet(std::unique_ptr<Cell>& cell, Position pos, std::string text){
-    try {
-        cell -> Set(std::move(text));
-    } catch (const ParsingError&){
-        return false;
+void Sheet::UpdateNumber(Position pos, const Cell& cell){
+    std::optional<double> number;
+    if (const double* input = cell.GetInput()){
+        number = *input;
+    } else if (!cell.IsEmpty() && !cell.GetFormula()){
+        number = ParseCellNumber(std::get<std::string>(cell.GetValue()));
+    }
+    if (number){
+        numbers_.Set(pos, *number);
+    } else {
+        numbers_.Reset(pos);
     }
-    return true;
 }
 
 void Sheet::SetCell(Position pos, std::string text){
     CheckPosValidation(pos);
 
-    if (table_.count(pos) != 0){
-        auto& cell = table_[pos];
-        if ((cell -> GetImpl() && cell -> GetText() != text)){
-            if (!SuccessSet(cell, pos, std::move(text))){
-                return ;
-            }
+    const auto it = table_.find(pos);
+    if (it == table_.end() || !it -> second.HasText(text)){
+        ReplaceCell(pos, CreateCell(pos, std::move(text)));
+    }
+
+    ExtendPrintableSize(pos);
+
+    FlushChanges();
+}
+
+void Sheet::SetNumber(Position pos, double value){
+    CheckPosValidation(pos);
+
+    const auto it = table_.find(pos);
+    const double* input = it != table_.end() ? it -> second.GetInput() : nullptr;
+    if (!input){
+        Cell cell;
+        cell.SetInput(value);
+        ReplaceCell(pos, std::move(cell));
+        ExtendPrintableSize(pos);
+    } else if (*input != value){
+        CancelRecalc();
+        it -> second.SetInput(value);
+        numbers_.Set(pos, value);
+        InvalidInputPos(pos);
+    }
+
+    FlushChanges();
+}
+
+void Sheet::SetNumbers(const std::vector<std::pair<Position, double>>& values){
+    for (const auto& [pos, value] : values){
+        CheckPosValidation(pos);
+    }
+    BeginBatch();
+    for (const auto& [pos, value] : values){
+        SetNumber(pos, value);
+    }
+    EndBatch();
+}
+
+void Sheet::ExtendPrintableSize(Position pos){
+    rows_ = pos.row + 1 > rows_ ? pos.row + 1 : rows_;
+    cols_ = pos.col + 1 > cols_ ? pos.col + 1 : cols_;
+}
+
+void Sheet::Import(std::vector<std::pair<Position, std::string>> cells, size_t threads){
+    for (const auto& [pos, text] : cells){
+        CheckPosValidation(pos);
+    }
+
+    // Из повторов позиции действует последний. Ячейки, текст которых не
+    // меняется, не разбираются и не сбрасывают кеши зависимых
+    std::unordered_map<Position, size_t, PositionHash> last_index;
+    for (size_t i = 0; i < cells.size(); ++i){
+        last_index[cells[i].first] = i;
+    }
+    size_t changed = 0;
+    for (size_t i = 0; i < cells.size(); ++i){
+        auto& [pos, text] = cells[i];
+        const Cell* cell = FindCell(pos);
+        if (last_index.at(pos) != i || (cell && cell -> HasText(text))){
+            continue;
+        }
+        if (changed != i){
+            cells[changed] = std::move(cells[i]);
+        }
+        ++changed;
+    }
+    cells.resize(changed);
 
+    // Разбор формул не зависит от таблицы и идёт параллельно
+    std::vector<std::unique_ptr<FormulaInterface>> formulas(cells.size());
+    std::vector<std::exception_ptr> errors(cells.size());
+    std::atomic<size_t> next_cell{0};
+    const auto parse = [&cells, &formulas, &errors, &next_cell](){
+        for (size_t i = next_cell++; i < cells.size(); i = next_cell++){
+            const std::string& text = cells[i].second;
+            if (!IsFormulaText(text)){
+                continue;
+            }
+            try {
+                formulas[i] = ParseFormula(text.substr(1));
+            } catch (...){
+                errors[i] = std::current_exception();
+            }
         }
+    };
+
+    if (threads == 0){
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const size_t formulas_count = std::count_if(cells.begin(), cells.end(), [](const auto& cell){
+        return IsFormulaText(cell.second);
+    });
+    threads = std::clamp<size_t>(formulas_count / PARSE_FORMULAS_PER_THREAD, 1, threads);
+    if (threads == 1){
+        parse();
     } else {
-        std::unique_ptr<Cell> cell = std::make_unique<Cell>(*this);
-        cell -> SetPos(pos);
-        if (SuccessSet(cell, pos, std::move(text))){
-            table_[pos] = std::move(cell);
+        GetWorkerPool().Run(threads - 1, parse);
+    }
+    for (const auto& error : errors){
+        if (error){
+            std::rethrow_exception(error);
+        }
+    }
+
+    std::vector<PreparedCell> prepared;
+    prepared.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i){
+        prepared.push_back({cells[i].first, std::move(cells[i].second), std::move(formulas[i])});
+    }
+    InstallCells(std::move(prepared));
+}
+
+void Sheet::CopyRange(CellRange source, Position target){
+    FillRange(source, {target, {target.row + source.last.row - source.first.row,
+                                target.col + source.last.col - source.first.col}});
+}
+
+void Sheet::FillRange(CellRange source, CellRange target){
+    for (const CellRange& range : {source, target}){
+        CheckPosValidation(range.first);
+        CheckPosValidation(range.last);
+        if (range.first.row > range.last.row || range.first.col > range.last.col){
+            throw InvalidPositionException{"Wrong cell range"s};
+        }
+    }
+
+    const int rows = source.last.row - source.first.row + 1;
+    const int cols = source.last.col - source.first.col + 1;
+    std::vector<PreparedCell> cells;
+    cells.reserve(static_cast<size_t>(target.last.row - target.first.row + 1)
+                  * (target.last.col - target.first.col + 1));
+    for (int row = target.first.row; row <= target.last.row; ++row){
+        for (int col = target.first.col; col <= target.last.col; ++col){
+            const Position pos{row, col};
+            const Position source_pos{source.first.row + (row - target.first.row) % rows,
+                                      source.first.col + (col - target.first.col) % cols};
+            const Cell* cell = FindCell(source_pos);
+            if (!cell && !FindCell(pos)){
+                continue;
+            }
+            PreparedCell prepared{pos, {}, nullptr};
+            if (const FormulaImpl* formula = cell ? cell -> GetFormula() : nullptr){
+                prepared.formula = formula -> Shift(row - source_pos.row, col - source_pos.col);
+            } else if (cell && !cell -> IsEmpty()){
+                prepared.text = cell -> GetText();
+            } else {
+                prepared.clear = true;
+            }
+            cells.push_back(std::move(prepared));
+        }
+    }
+    InstallCells(std::move(cells));
+}
+
+void Sheet::InstallCells(std::vector<PreparedCell> cells){
+    std::unordered_map<Position, size_t, PositionHash> last_index;
+    std::unordered_map<Position, const FormulaInterface*, PositionHash> new_formulas;
+    for (size_t i = 0; i < cells.size(); ++i){
+        const auto& cell = cells[i];
+        last_index[cell.pos] = i;
+        new_formulas[cell.pos] = cell.formula.get();
+    }
+    CheckCircularDependencies(new_formulas);
+
+    BeginBatch();
+    bool may_shrink = false;
+    for (size_t i = 0; i < cells.size(); ++i){
+        auto& prepared = cells[i];
+        if (last_index.at(prepared.pos) != i){
+            continue;
+        }
+        if (prepared.clear){
+            may_shrink = EraseCell(prepared.pos) || may_shrink;
+            continue;
+        }
+        Cell cell;
+        if (prepared.formula){
+            cell.SetFormula(std::make_unique<FormulaImpl>(std::move(prepared.formula), *this, prepared.pos));
         } else {
-            return;
+            cell.SetText(std::move(prepared.text));
         }
+        ReplaceCell(prepared.pos, std::move(cell));
+        ExtendPrintableSize(prepared.pos);
+    }
+    if (may_shrink){
+        ReducePrintableSize();
     }
+    EndBatch();
+}
 
-    rows_ = pos.row + 1 > rows_ ? pos.row + 1 : rows_;
-    cols_ = pos.col + 1 > cols_ ? pos.col + 1 : cols_;
+void Sheet::CheckCircularDependencies(
+        const std::unordered_map<Position, const FormulaInterface*, PositionHash>& new_formulas) const {
+    const auto is_formula = [this, &new_formulas](Position pos){
+        if (const auto it = new_formulas.find(pos); it != new_formulas.end()){
+            return it -> second != nullptr;
+        }
+        const Cell* cell = FindCell(pos);
+        return cell && cell -> GetFormula();
+    };
+    // Из ячеек областей цикл могут продолжить только формулы
+    const auto references = [this, &new_formulas, &is_formula](Position pos){
+        std::vector<Position> reff_cells;
+        std::vector<CellRange> reff_ranges;
+        if (const auto it = new_formulas.find(pos); it != new_formulas.end()){
+            if (it -> second){
+                reff_cells = it -> second -> GetReferencedCells();
+                reff_ranges = it -> second -> GetReferencedRanges();
+            }
+        } else if (const Cell* cell = FindCell(pos)){
+            reff_cells = cell -> GetReferencedCells();
+            reff_ranges = cell -> GetReferencedRanges();
+        }
+        AppendRangeCells(reff_ranges, is_formula, reff_cells);
+        return reff_cells;
+    };
+
+    // Старые ячейки циклов не содержат, поэтому достаточно обойти в глубину
+    // всё, что достижимо из новых ячеек
+    enum class Mark { InProgress, Done };
+    std::unordered_map<Position, Mark, PositionHash> marks;
+    struct Frame {
+        Position pos;
+        std::vector<Position> reff_cells;
+        size_t next = 0;
+    };
+    std::vector<Frame> stack;
+    for (const auto& [start, formula] : new_formulas){
+        if (marks.count(start) != 0){
+            continue;
+        }
+        marks[start] = Mark::InProgress;
+        stack.push_back({start, references(start)});
+        while (!stack.empty()){
+            Frame& frame = stack.back();
+            if (frame.next == frame.reff_cells.size()){
+                marks[frame.pos] = Mark::Done;
+                stack.pop_back();
+                continue;
+            }
+            const Position pos = frame.reff_cells[frame.next++];
+            const auto it = marks.find(pos);
+            if (it == marks.end()){
+                marks[pos] = Mark::InProgress;
+                stack.push_back({pos, references(pos)});
+            } else if (it -> second == Mark::InProgress){
+                throw CircularDependencyException{"Wrong formula with circular"s};
+            }
+        }
+    }
 }
 
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     CheckPosValidation(pos);
 
-    return table_.count(pos) != 0 ? table_.at(pos).get() 
-        : pos.col < cols_ && pos.row < rows_ ? EmptyCell.get() : nullptr;
+    const auto it = table_.find(pos);
+    return it != table_.end() ? &it -> second
+        : pos.col < cols_ && pos.row < rows_ ? &EmptyCell : nullptr;
 }
 
 CellInterface* Sheet::GetCell(Position pos){
     CheckPosValidation(pos);
 
-    return table_.count(pos) != 0 ? table_[pos].get() 
-        : pos.col < cols_ && pos.row < rows_ ? EmptyCell.get() : nullptr;
+    const auto it = table_.find(pos);
+    return it != table_.end() ? &it -> second
+        : pos.col < cols_ && pos.row < rows_ ? &EmptyCell : nullptr;
 }
 
 void Sheet::ReducePrintableSize(){
@@ -116,17 +482,24 @@ Size Sheet::GetPrintableSize() const {
 void Sheet::ClearCell(Position pos){
     CheckPosValidation(pos);
 
-    if (pos.row < rows_ && pos.col < cols_){
-        if (table_.count(pos) != 0){
-            table_[pos] -> Clear();
-            table_.erase(pos);
+    if (EraseCell(pos)){
+        ReducePrintableSize();
+    }
 
-            if ((pos.col == cols_ - 1 && pos.row < rows_)
-                || (pos.row == rows_ - 1 && pos.col < cols_)){
-                ReducePrintableSize();
-            }
-        }
+    FlushChanges();
+}
+
+bool Sheet::EraseCell(Position pos){
+    const auto it = table_.find(pos);
+    if (it == table_.end()){
+        return false;
     }
+    CancelRecalc();
+    InvalidCachePos(pos);
+    dependencies_.SetPrecedents(pos, {});
+    numbers_.Reset(pos);
+    table_.erase(it);
+    return (pos.col == cols_ - 1 && pos.row < rows_) || (pos.row == rows_ - 1 && pos.col < cols_);
 }
 
 void Sheet::PrintValues(std::ostream& out) const {
@@ -135,7 +508,7 @@ void Sheet::PrintValues(std::ostream& out) const {
             if (table_.count({row, col}) != 0){
                 std::visit(
                     [&out](auto&& element){out << element;},
-                    table_.at({row, col}) -> GetValue()
+                    table_.at({row, col}).GetValue()
                 );
             }
             if (col < cols_ - 1){
@@ -151,7 +524,7 @@ void Sheet::PrintTexts(std::ostream& out) const{
     for (int row = 0; row < rows_; ++row){
         for (int col = 0; col < cols_; ++col){
             if (table_.count({row, col}) != 0){
-                out << table_.at({row, col}) -> GetText();
+                out << table_.at({row, col}).GetText();
             }
             if (col < cols_ - 1){
                 out << '\t';
@@ -161,6 +534,432 @@ void Sheet::PrintTexts(std::ostream& out) const{
     }
 }
 
+void Sheet::NotifyChanged(Position pos){
+    if (!subscribers_.empty()){
+        changed_cells_.push_back(pos);
+    }
+    if (snapshot_){
+        dirty_tiles_.insert(SheetSnapshot::GetTileKey(pos));
+    }
+    if (const auto it = column_indexes_.find(pos.col); it != column_indexes_.end()){
+        auto& indexes = it -> second;
+        // В каждом классе высоты перебираются только отрезки, которые могут
+        // содержать pos.row
+        for (auto index = indexes.begin(); index != indexes.end();){
+            const int height_class = std::get<0>(index -> first);
+            const int min_first_row = pos.row - (2 << height_class) + 1;
+            for (index = indexes.lower_bound({height_class, min_first_row, 0});
+                    index != indexes.end() && std::get<0>(index -> first) == height_class
+                    && std::get<1>(index -> first) <= pos.row;){
+                index = pos.row <= std::get<2>(index -> first) ? indexes.erase(index) : std::next(index);
+            }
+            index = indexes.lower_bound({height_class + 1, INT_MIN, 0});
+        }
+        if (indexes.empty()){
+            column_indexes_.erase(it);
+        }
+    }
+}
+
+void Sheet::FlushChanges(){
+    if (batch_depth_ > 0 || changed_cells_.empty()){
+        return;
+    }
+    const std::vector<CellRange> changed = CompressToRanges(std::move(changed_cells_));
+    changed_cells_.clear();
+
+    // Копия защищает обход от подписок и отписок из самих обработчиков
+    const auto subscribers = subscribers_;
+    for (const auto& [subscription, callback] : subscribers){
+        callback(changed);
+    }
+}
+
+size_t Sheet::Subscribe(ChangeCallback callback){
+    subscribers_.emplace_back(next_subscription_, std::move(callback));
+    return next_subscription_++;
+}
+
+void Sheet::Unsubscribe(size_t subscription){
+    subscribers_.erase(std::remove_if(subscribers_.begin(), subscribers_.end(),
+        [subscription](const auto& subscriber){
+            return subscriber.first == subscription;
+        }), subscribers_.end());
+    if (subscribers_.empty()){
+        changed_cells_.clear();
+    }
+}
+
+void Sheet::BeginBatch(){
+    ++batch_depth_;
+}
+
+void Sheet::EndBatch(){
+    if (batch_depth_ > 0 && --batch_depth_ == 0){
+        FlushChanges();
+    }
+}
+
+size_t Sheet::MemoryUsage::GetTotal() const {
+    return empty_bytes + text_bytes + formula_bytes + input_bytes + dependency_bytes + numeric_bytes
+           + index_bytes;
+}
+
+Sheet::MemoryUsage Sheet::GetMemoryUsage() const {
+    // Узел хеш-таблицы: указатель на следующий узел плюс слот в массиве корзин
+    constexpr size_t node_overhead = 2 * sizeof(void*);
+    constexpr size_t cell_size = node_overhead + sizeof(std::pair<const Position, Cell>);
+
+    MemoryUsage usage;
+    for (const auto& [pos, cell] : table_){
+        const size_t bytes = cell_size + cell.GetHeapUsage();
+        if (cell.GetFormula()){
+            ++usage.formula_cells;
+            usage.formula_bytes += bytes;
+        } else if (cell.GetInput()){
+            ++usage.input_cells;
+            usage.input_bytes += bytes;
+        } else if (cell.IsEmpty()){
+            ++usage.empty_cells;
+            usage.empty_bytes += bytes;
+        } else {
+            ++usage.text_cells;
+            usage.text_bytes += bytes;
+        }
+    }
+
+    usage.dependency_bytes = dependencies_.GetMemoryUsage();
+    usage.numeric_bytes = numbers_.GetMemoryUsage();
+
+    std::lock_guard guard(values_mutex_);
+    for (const auto& [col, indexes] : column_indexes_){
+        for (const auto& [rows, index] : indexes){
+            usage.index_bytes += sizeof(std::pair<const std::tuple<int, int, int>, ColumnIndex>)
+                                 + 3 * sizeof(void*) + index.GetMemoryUsage();
+        }
+    }
+    return usage;
+}
+
+std::vector<Sheet::DependencyChain> Sheet::GetDeepestChains(size_t count) const {
+    std::unordered_map<Position, DependencyChain, PositionHash> chains;
+    std::vector<std::pair<Position, bool>> stack;
+    for (const auto& [start, cell] : table_){
+        stack.push_back({start, false});
+        while (!stack.empty()){
+            const auto [pos, expanded] = stack.back();
+            stack.pop_back();
+            if (chains.count(pos) != 0){
+                continue;
+            }
+            const auto it = table_.find(pos);
+            std::vector<Position> reff_cells;
+            if (it != table_.end()){
+                reff_cells = it -> second.GetReferencedCells();
+                AppendRangeCells(it -> second.GetReferencedRanges(), [this](Position reff){
+                    return table_.count(reff) != 0;
+                }, reff_cells);
+            }
+            if (!expanded){
+                stack.push_back({pos, true});
+                for (auto reff : reff_cells){
+                    if (chains.count(reff) == 0){
+                        stack.push_back({reff, false});
+                    }
+                }
+                continue;
+            }
+            DependencyChain chain{pos, pos, 1};
+            for (auto reff : reff_cells){
+                const auto& prev = chains.at(reff);
+                if (prev.length + 1 > chain.length){
+                    chain.first = prev.first;
+                    chain.length = prev.length + 1;
+                }
+            }
+            chains[pos] = chain;
+        }
+    }
+
+    std::vector<DependencyChain> result;
+    result.reserve(chains.size());
+    for (const auto& [pos, chain] : chains){
+        if (table_.count(pos) != 0){
+            result.push_back(chain);
+        }
+    }
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(),
+        [](const DependencyChain& lhs, const DependencyChain& rhs){
+            return lhs.length > rhs.length;
+        });
+    result.resize(count);
+    return result;
+}
+
+#ifdef SPREADSHEET_PROFILE
+RecalcProfiler& Sheet::GetProfiler() const {
+    return profiler_;
+}
+
+void Sheet::PrintProfile(std::ostream& out, size_t count) const {
+    profiler_.PrintReport(out, count);
+    out << '\n' << "chain_end\tchain_start\tlength\n";
+    for (const auto& chain : GetDeepestChains(count)){
+        out << chain.last.ToString() << '\t' << chain.first.ToString() << '\t' << chain.length << '\n';
+    }
+}
+#endif
+
+std::vector<std::pair<Position, const CellInterface*>> Sheet::CollectCells() const {
+    std::vector<std::pair<Position, const CellInterface*>> cells;
+    cells.reserve(table_.size());
+    for (const auto& [pos, cell] : table_){
+        if (!cell.IsEmpty()){
+            cells.push_back({pos, &cell});
+        }
+    }
+    return cells;
+}
+
+FrozenSheet Sheet::Freeze() const {
+    return FrozenSheet({rows_, cols_}, CollectCells());
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot(){
+    const Size size{rows_, cols_};
+    if (snapshot_ && dirty_tiles_.empty() && snapshot_ -> GetPrintableSize() == size){
+        return snapshot_;
+    }
+
+    // Ячейки плиток, которые надо собрать заново. Плитка без ячеек удаляется
+    constexpr size_t tile_area = SheetSnapshot::TILE_SIZE * SheetSnapshot::TILE_SIZE;
+    std::unordered_map<SheetSnapshot::TileKey, std::vector<std::pair<Position, const CellInterface*>>> changed;
+    for (const SheetSnapshot::TileKey key : dirty_tiles_){
+        changed[key];
+    }
+    if (!snapshot_ || dirty_tiles_.size() * tile_area > table_.size()){
+        for (const auto& [pos, cell] : table_){
+            if (cell.IsEmpty()){
+                continue;
+            }
+            const SheetSnapshot::TileKey key = SheetSnapshot::GetTileKey(pos);
+            if (!snapshot_){
+                changed[key].push_back({pos, &cell});
+            } else if (const auto it = changed.find(key); it != changed.end()){
+                it -> second.push_back({pos, &cell});
+            }
+        }
+    } else {
+        for (auto& [key, cells] : changed){
+            const Position origin = SheetSnapshot::GetTileOrigin(key);
+            for (int row = origin.row; row < origin.row + SheetSnapshot::TILE_SIZE; ++row){
+                for (int col = origin.col; col < origin.col + SheetSnapshot::TILE_SIZE; ++col){
+                    const Cell* cell = FindCell({row, col});
+                    if (cell && !cell -> IsEmpty()){
+                        cells.push_back({{row, col}, cell});
+                    }
+                }
+            }
+        }
+    }
+
+    SheetSnapshot::Tiles tiles = snapshot_ ? snapshot_ -> GetTiles() : SheetSnapshot::Tiles{};
+    for (const auto& [key, cells] : changed){
+        if (cells.empty()){
+            tiles.erase(key);
+        } else {
+            tiles[key] = std::make_shared<const FrozenSheet>(Size{Position::MAX_ROWS, Position::MAX_COLS}, cells);
+        }
+    }
+    const std::uint64_t version = snapshot_ ? snapshot_ -> GetVersion() + 1 : 1;
+    snapshot_ = std::make_shared<const SheetSnapshot>(size, version, std::move(tiles));
+    dirty_tiles_.clear();
+    return snapshot_;
+}
+
+void Sheet::Save(const std::string& path) const {
+    WriteMappedSheet(path, {rows_, cols_}, CollectCells());
+}
+
+void Sheet::ExportColumns(CellRange range, ColumnarValues& out) const {
+    CheckPosValidation(range.first);
+    CheckPosValidation(range.last);
+    if (range.first.row > range.last.row || range.first.col > range.last.col){
+        throw InvalidPositionException{"Wrong cell range"s};
+    }
+
+    out.Reset(range.last.row - range.first.row + 1, range.last.col - range.first.col + 1);
+    std::vector<const Cell*> cells(out.kinds.size(), nullptr);
+    if (table_.size() < cells.size()){
+        for (const auto& [pos, cell] : table_){
+            if (range.first.row <= pos.row && pos.row <= range.last.row
+                    && range.first.col <= pos.col && pos.col <= range.last.col){
+                cells[out.GetIndex(pos.row - range.first.row, pos.col - range.first.col)] = &cell;
+            }
+        }
+    } else {
+        for (int col = 0; col < out.cols; ++col){
+            for (int row = 0; row < out.rows; ++row){
+                cells[out.GetIndex(row, col)] = FindCell({range.first.row + row, range.first.col + col});
+            }
+        }
+    }
+
+    for (size_t i = 0; i < cells.size(); ++i){
+        const Cell* cell = cells[i];
+        if (const FormulaImpl* formula = cell ? cell -> GetFormula() : nullptr){
+            const auto value = formula -> GetValue();
+            if (const auto* number = std::get_if<double>(&value)){
+                out.kinds[i] = ColumnarValues::Kind::Number;
+                out.numbers[i] = *number;
+            } else if (const auto* error = std::get_if<FormulaError>(&value)){
+                out.kinds[i] = ColumnarValues::Kind::Error;
+                out.errors[i] = error -> GetCategory();
+            }
+        } else if (cell && cell -> GetInput()){
+            // Само число попадёт в numbers из NumericColumns
+            out.kinds[i] = ColumnarValues::Kind::Number;
+        } else if (cell && !cell -> IsEmpty()){
+            const std::string_view text = cell -> GetTextValue();
+            out.kinds[i] = ColumnarValues::Kind::Text;
+            out.texts.insert(out.texts.end(), text.begin(), text.end());
+        }
+        out.text_offsets[i + 1] = out.texts.size();
+    }
+
+    for (int col = 0; col < out.cols; ++col){
+        const NumericColumns::Column* column = numbers_.GetColumn(range.first.col + col);
+        if (!column){
+            continue;
+        }
+        for (int row = 0; row < out.rows; ++row){
+            if (column -> IsValid(range.first.row + row)){
+                out.numbers[out.GetIndex(row, col)] = column -> GetValue(range.first.row + row);
+            }
+        }
+    }
+}
+
+RecalcHandle Sheet::RecalcAsync(){
+    CancelRecalc();
+    // Чтение, вычисляющее формулы, либо закончится до начала пересчёта,
+    // либо увидит, что он идёт
+    std::lock_guard guard(values_mutex_);
+
+    // Обход в глубину по зависимым ячейкам от каждой устаревшей формулы:
+    // ячейка завершается после всех устаревших формул, которые от неё
+    // зависят, и в обратном порядке завершения встаёт после всех, на
+    // которые ссылается. Тогда каждый шаг пересчёта вычисляет одну формулу
+    // по готовым значениям. Зависимые по областям граф находит, не
+    // перебирая ячеек областей
+    auto state = std::make_shared<RecalcHandle::State>();
+    std::unordered_set<const FormulaImpl*> visited;
+    std::vector<std::pair<Position, bool>> stack;
+    const auto is_stale = [this, &visited](Position pos){
+        const Cell* cell = FindCell(pos);
+        const FormulaImpl* formula = cell ? cell -> GetFormula() : nullptr;
+        return formula && formula -> NeedsEvaluation() && visited.count(formula) == 0;
+    };
+    for (const auto& [start, start_cell] : table_){
+        if (!is_stale(start)){
+            continue;
+        }
+        stack.push_back({start, false});
+        while (!stack.empty()){
+            const auto [pos, expanded] = stack.back();
+            const FormulaImpl* formula = FindCell(pos) -> GetFormula();
+            if (expanded){
+                stack.pop_back();
+                state -> order.push_back(pos);
+            } else if (!visited.insert(formula).second){
+                stack.pop_back();
+            } else {
+                stack.back().second = true;
+                for (const Position depended : dependencies_.GetDependents(pos)){
+                    if (is_stale(depended)){
+                        stack.push_back({depended, false});
+                    }
+                }
+            }
+        }
+    }
+    std::reverse(state -> order.begin(), state -> order.end());
+
+    recalc_ = state;
+    recalc_running_ = true;
+    recalc_thread_ = std::thread([this, &state = *state](){
+        Recalc(state);
+    });
+    return RecalcHandle(std::move(state));
+}
+
+void Sheet::Recalc(RecalcHandle::State& state){
+    bool completed = true;
+    for (size_t i = 0; i < state.order.size() && completed;){
+        std::lock_guard guard(values_mutex_);
+        for (const size_t end = std::min(i + RECALC_STEP, state.order.size()); i < end; ++i){
+            if (state.cancelled){
+                completed = false;
+                break;
+            }
+            FindCell(state.order[i]) -> GetFormula() -> Refresh();
+            state.evaluated = i + 1;
+        }
+    }
+    recalc_running_ = false;
+    state.done.set_value(completed);
+}
+
+void Sheet::CancelRecalc(){
+    if (recalc_thread_.joinable()){
+        recalc_ -> cancelled = true;
+        recalc_thread_.join();
+        recalc_.reset();
+    }
+}
+
+std::unique_lock<std::recursive_mutex> Sheet::LockValues() const {
+    if (recalc_running_){
+        return {};
+    }
+    std::unique_lock lock(values_mutex_);
+    if (recalc_running_){
+        return {};
+    }
+    return lock;
+}
+
+std::optional<CellInterface::Value> Sheet::GetLastValue(Position pos) const {
+    CheckPosValidation(pos);
+
+    const Cell* cell = FindCell(pos);
+    if (const FormulaImpl* formula = cell ? cell -> GetFormula() : nullptr){
+        return formula -> GetLastValue();
+    }
+    return cell ? cell -> GetValue() : CellInterface::Value{};
+}
+
+std::optional<double> Sheet::GetNumber(Position pos) const {
+    return numbers_.Get(pos);
+}
+
+const ColumnIndex* Sheet::GetColumnIndex(int col, int first_row, int last_row) const {
+    auto& indexes = column_indexes_[col];
+    const std::tuple rows{CellRange{{first_row, col}, {last_row, col}}.GetHeightClass(), first_row, last_row};
+    if (const auto it = indexes.find(rows); it != indexes.end()){
+        return &it -> second;
+    }
+    // Построение вычисляет формулы отрезка, а они могут строить свои
+    // индексы, поэтому в таблицу попадает только готовый индекс
+    ColumnIndex index(*this, col, first_row, last_row);
+    return &indexes.emplace(rows, std::move(index)).first -> second;
+}
+
+const NumericColumns& Sheet::GetNumbers() const {
+    return numbers_;
+}
+
 std::unique_ptr<SheetInterface> CreateSheet(){
     return std::make_unique<Sheet>();
 }
\ No newline at end of file
@@ -1,50 +1,299 @@
 #pragma once
 
 #include "cell.h"
+#include "column_index.h"
+#include "columnar_values.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "frozen_sheet.h"
+#include "mapped_sheet.h"
+#include "numeric_columns.h"
+#include "profiler.h"
+#include "sheet_snapshot.h"
 
+#include <atomic>
+#include <functional>
+#include <future>
+#include <iosfwd>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 
+// Фоновый пересчёт, запущенный Sheet::RecalcAsync. Копии ссылаются на один
+// и тот же пересчёт и могут использоваться из любых потоков
+class RecalcHandle {
+public:
+    struct Progress {
+        size_t evaluated = 0;
+        size_t remaining = 0;
+    };
+
+    Progress GetProgress() const;
+    bool IsDone() const;
+
+    // Ждёт окончания пересчёта. false, если пересчёт был отменён
+    bool Wait() const;
+
+    // Просит пересчёт остановиться и не ждёт этого. Посчитанные значения
+    // остаются в кеше
+    void Cancel();
+
+private:
+    friend class Sheet;
+
+    struct State {
+        // Ячейки в порядке вычисления: каждая после всех, от которых зависит
+        std::vector<Position> order;
+        std::atomic<size_t> evaluated{0};
+        std::atomic<bool> cancelled{false};
+        std::promise<bool> done;
+        std::shared_future<bool> finished = done.get_future().share();
+    };
+
+    explicit RecalcHandle(std::shared_ptr<State> state);
+
+    std::shared_ptr<State> state_;
+};
+
 class Sheet : public SheetInterface{
 private:
 
-    const std::unique_ptr<Cell> EmptyCell = std::make_unique<Cell>(*this);
+    Cell EmptyCell;
 
-    std::unordered_map<Position, std::unique_ptr<Cell>, PositionHash> table_;
-    using DependedCells = std::unordered_set<Position, PositionHash>;
-    std::unordered_map<
-        Position, DependedCells,
-        PositionHash> depended_cells_;
+    // Ячейки хранятся в узлах таблицы, указатели на них стабильны
+    std::unordered_map<Position, Cell, PositionHash> table_;
+    DependencyGraph dependencies_;
+    NumericColumns numbers_;
     int rows_ = 0;
     int cols_ = 0;
+#ifdef SPREADSHEET_PROFILE
+    mutable RecalcProfiler profiler_;
+#endif
+    std::vector<std::pair<size_t, std::function<void(const std::vector<CellRange>&)>>> subscribers_;
+    size_t next_subscription_ = 0;
+    int batch_depth_ = 0;
+    std::vector<Position> changed_cells_;
+
+    // Формулы вычисляются под values_mutex_, а пока идёт фоновый пересчёт -
+    // только в нём; остальные читают последние значения без блокировок.
+    // Структуру таблицы пересчёт не трогает, а любая правка сначала его отменяет
+    std::shared_ptr<RecalcHandle::State> recalc_;
+    std::thread recalc_thread_;
+    std::atomic<bool> recalc_running_{false};
+    mutable std::recursive_mutex values_mutex_;
+
+    void Recalc(RecalcHandle::State& state);
+    void CancelRecalc();
+
+    // Последняя выданная версия и плитки, в которых с тех пор что-то
+    // изменилось. Пока версий не было, изменения не отслеживаются
+    std::shared_ptr<const SheetSnapshot> snapshot_;
+    std::unordered_set<SheetSnapshot::TileKey> dirty_tiles_;
+
+    // Индексы функций поиска по столбцам и отрезкам строк, с ключом (класс
+    // высоты, первая строка, последняя строка). Строятся при первом поиске
+    // и удаляются, как только значение ячейки отрезка может измениться.
+    // Как и кеши формул, меняются под values_mutex_
+    mutable std::unordered_map<int, std::map<std::tuple<int, int, int>, ColumnIndex>> column_indexes_;
+
     void ReducePrintableSize();
+    // Сообщает подписчикам и версиям, что значение ячейки могло измениться,
+    // и удаляет индексы, в которые она входит
+    void NotifyChanged(Position pos);
+    void FlushChanges();
+
+    // Разбирает текст и проверяет циклы, не меняя таблицу
+    Cell CreateCell(Position pos, std::string text) const;
+    void ReplaceCell(Position pos, Cell cell);
+    void ExtendPrintableSize(Position pos);
+
+    // Ячейка с уже разобранной формулой (formula) или с текстом (text).
+    // clear удаляет ячейку, как ClearCell
+    struct PreparedCell {
+        Position pos;
+        std::string text;
+        std::unique_ptr<FormulaInterface> formula;
+        bool clear = false;
+    };
+
+    // Проверяет циклы во всей таблице с новыми ячейками и только потом
+    // заменяет ими старые. При повторах позиции побеждает последняя ячейка
+    void InstallCells(std::vector<PreparedCell> cells);
 
-    bool SuccessSet(std::unique_ptr<Cell>& cell, Position pos, std::string text);
+    // Бросает CircularDependencyException, если таблица, в которой ячейки
+    // new_formulas заменены указанными формулами (nullptr - не формула),
+    // содержит цикл
+    void CheckCircularDependencies(
+        const std::unordered_map<Position, const FormulaInterface*, PositionHash>& new_formulas) const;
+    void UpdateNumber(Position pos, const Cell& cell);
+    // Удаляет ячейку из таблицы. true, если она лежала на границе печатной
+    // области и область может уменьшиться
+    bool EraseCell(Position pos);
 
-    void InvalidateCache(const DependedCells& depended_cells);
+    void InvalidCachePos(Position pos);
+    // То же для нового значения входной ячейки. Формула, которая уже ждёт
+    // пересчёта, сброшена вместе со всеми зависимыми от неё, и о ней уже
+    // сообщено подписчикам, поэтому волна на ней останавливается: частые
+    // обновления входов между чтениями обходят зависимые ячейки один раз
+    void InvalidInputPos(Position pos);
 
     void CheckPosValidation(Position pos) const;
+
+    // Непустые ячейки в произвольном порядке
+    std::vector<std::pair<Position, const CellInterface*>> CollectCells() const;
 public:
+    // Самая длинная цепочка ссылок из length ячеек, заканчивающаяся ячейкой last:
+    // last ссылается на ячейку, которая ссылается на ..., которая ссылается на first
+    struct DependencyChain {
+        Position first;
+        Position last;
+        int length = 0;
+    };
+
+    using ChangeCallback = std::function<void(const std::vector<CellRange>& changed)>;
+
+    // Оценка занятой памяти в байтах по типам ячеек
+    struct MemoryUsage {
+        size_t empty_cells = 0;
+        size_t empty_bytes = 0;
+        size_t text_cells = 0;
+        size_t text_bytes = 0;
+        size_t formula_cells = 0;
+        size_t formula_bytes = 0;
+        size_t input_cells = 0;
+        size_t input_bytes = 0;
+        // Граф ссылок между ячейками
+        size_t dependency_bytes = 0;
+        // Разобранные числа текстовых ячеек
+        size_t numeric_bytes = 0;
+        // Индексы функций поиска
+        size_t index_bytes = 0;
+
+        size_t GetTotal() const;
+    };
+
     ~Sheet();
 
     Sheet() = default;
 
     void SetCell(Position pos, std::string text) override;
+
+    // Делает ячейку входной: её значение - число value, текст - кратчайшая
+    // запись этого числа. Повторный вызов для входной ячейки только меняет
+    // число и сбрасывает кеши зависимых формул, ничего не разбирая
+    void SetNumber(Position pos, double value);
+
+    // SetNumber для всех values одним пакетом с одним уведомлением
+    void SetNumbers(const std::vector<std::pair<Position, double>>& values);
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
     void ClearCell(Position pos) override;
 
+    // Массовая загрузка: формулы разбираются параллельно, не более чем в
+    // threads потоках (0 - по числу ядер) из общего пула, небольшие пакеты -
+    // в вызывающем потоке. Затем ячейки устанавливаются в одном потоке с
+    // общей проверкой циклов. При любой ошибке таблица не меняется
+    void Import(std::vector<std::pair<Position, std::string>> cells, size_t threads = 0);
+
+    // Копирует область source так, что её левый верхний угол попадает в
+    // target. Формулы не разбираются заново: ссылки в них сдвигаются вместе
+    // с ячейкой, ссылки за край таблицы становятся #REF!. Пустые ячейки
+    // источника очищают ячейки назначения, как ClearCell.
+    // При ошибке (цикл, выход за таблицу) таблица не меняется
+    void CopyRange(CellRange source, Position target);
+
+    // Заполняет область target повторениями области source, как при
+    // протягивании вниз или вправо
+    void FillRange(CellRange source, CellRange target);
+
     Size GetPrintableSize() const override;
 
     void PrintValues(std::ostream& out) const override;
     void PrintTexts(std::ostream& out) const override;
-    void InvalidCachePos(Position pos);
 
-    void RemoveOldDependedCells(Position cell, const std::vector<Position>& cells);
+    std::optional<double> GetNumber(Position pos) const override;
+
+    const ColumnIndex* GetColumnIndex(int col, int first_row, int last_row) const override;
+
+    // Числа из текстовых и входных ячеек по столбцам
+    const NumericColumns& GetNumbers() const;
+
+    // Ячейка таблицы или nullptr, если по позиции ничего не задано
+    const Cell* FindCell(Position pos) const;
+
+    // Вычисляет все устаревшие формулы в фоновом потоке. Следующая правка
+    // таблицы или следующий RecalcAsync отменяет пересчёт и ждёт, пока он
+    // остановится: это занимает не дольше вычисления нескольких ячеек.
+    // Пока пересчёт идёт, GetValue формул ничего не вычисляет и не ждёт, а
+    // возвращает последнее посчитанное значение
+    RecalcHandle RecalcAsync();
+
+    // Значение ячейки без вычислений: для формулы - последнее посчитанное,
+    // даже если с тех пор ячейки, от которых она зависит, изменились.
+    // nullopt, если формула ещё ни разу не вычислялась
+    std::optional<CellInterface::Value> GetLastValue(Position pos) const;
+
+    // Блокировка для вычисления формул вне фонового пересчёта. Пуста, если
+    // пересчёт идёт: он начинается под той же блокировкой, так что чтение,
+    // получившее её, закончит вычисления до его начала
+    std::unique_lock<std::recursive_mutex> LockValues() const;
+
+    // Ссылки между ячейками в обе стороны
+    const DependencyGraph& GetDependencies() const;
+
+    // От чего зависит значение ячейки pos и на что оно влияет: ячейки не
+    // дальше limits.max_depth ссылок, не больше limits.max_results штук
+    DependencyGraph::Trace TracePrecedents(Position pos, DependencyGraph::TraceLimits limits = {}) const;
+    DependencyGraph::Trace TraceDependents(Position pos, DependencyGraph::TraceLimits limits = {}) const;
+
+    // Бросает CircularDependencyException, если формула в ячейке cell со
+    // ссылками reff_cells и областями reff_ranges замкнёт цикл
+    void CheckCircularDependency(Position cell, const std::vector<Position>& reff_cells,
+                                 const std::vector<CellRange>& reff_ranges = {}) const;
+
+    // Подписка на изменения: после каждого SetCell/ClearCell (или после
+    // EndBatch) callback получает области ячеек, значения которых могли
+    // измениться. Возвращает идентификатор для Unsubscribe
+    size_t Subscribe(ChangeCallback callback);
+    void Unsubscribe(size_t subscription);
+
+    MemoryUsage GetMemoryUsage() const;
+
+    // Вычисляет все формулы и возвращает неизменяемую копию таблицы
+    FrozenSheet Freeze() const;
+
+    // Неизменяемая версия таблицы для читателей из других потоков. Формулы
+    // вычисляются только в плитках, изменённых после предыдущей версии,
+    // остальные плитки общие с ней. Без изменений возвращает ту же версию
+    std::shared_ptr<const SheetSnapshot> Snapshot();
+
+    // Вычисляет все формулы и записывает таблицу в файл для MappedSheet
+    void Save(const std::string& path) const;
+
+    // Вычисляет формулы области range и раскладывает её значения по
+    // столбцам в out. Ячейки ищутся одним проходом по таблице или области,
+    // смотря что меньше, числа текстовых ячеек копируются из NumericColumns
+    void ExportColumns(CellRange range, ColumnarValues& out) const;
+
+    // Изменения между BeginBatch и EndBatch доставляются подписчикам одним
+    // уведомлением. Пакеты могут быть вложенными
+    void BeginBatch();
+    void EndBatch();
+
+    // count самых длинных цепочек зависимостей, по убыванию длины
+    std::vector<DependencyChain> GetDeepestChains(size_t count) const;
+
+#ifdef SPREADSHEET_PROFILE
+    RecalcProfiler& GetProfiler() const;
 
-    void AddNewDependedCells(Position cell, const std::vector<Position>& cells);
+    // Отчёт о самых дорогих ячейках и самых длинных цепочках зависимостей
+    void PrintProfile(std::ostream& out, size_t count = 10) const;
+#endif
 };
@@ -0,0 +1,97 @@
+#include "sheet_snapshot.h"
+
+#include <algorithm>
+#include <ostream>
+#include <utility>
+#include <variant>
+
+using namespace std::literals;
+
+SheetSnapshot::TileKey SheetSnapshot::GetTileKey(Position pos){
+    return static_cast<TileKey>(pos.row / TILE_SIZE) << 16 | static_cast<TileKey>(pos.col / TILE_SIZE);
+}
+
+Position SheetSnapshot::GetTileOrigin(TileKey key){
+    return {static_cast<int>(key >> 16) * TILE_SIZE, static_cast<int>(key & 0xFFFF) * TILE_SIZE};
+}
+
+SheetSnapshot::SheetSnapshot(Size size, std::uint64_t version, Tiles tiles)
+    : size_(size)
+    , version_(version)
+    , tiles_(std::move(tiles))
+    , empty_tile_({Position::MAX_ROWS, Position::MAX_COLS}, {}){
+}
+
+void SheetSnapshot::SetCell(Position, std::string){
+    throw ReadOnlySheetException{"Sheet snapshot is read-only"s};
+}
+
+void SheetSnapshot::ClearCell(Position){
+    throw ReadOnlySheetException{"Sheet snapshot is read-only"s};
+}
+
+const FrozenSheet& SheetSnapshot::GetTile(Position pos) const {
+    const auto it = tiles_.find(GetTileKey(pos));
+    return it != tiles_.end() ? *it -> second : empty_tile_;
+}
+
+const CellInterface* SheetSnapshot::GetCell(Position pos) const {
+    if (!pos.IsValid()){
+        throw InvalidPositionException{"Wrong cell position, out of table"s};
+    }
+    if (pos.row >= size_.rows || pos.col >= size_.cols){
+        return nullptr;
+    }
+    return GetTile(pos).GetCell(pos);
+}
+
+CellInterface* SheetSnapshot::GetCell(Position pos){
+    // У FrozenCell нет изменяющих методов, отдавать её без const безопасно
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+    return size_;
+}
+
+template <typename Printer>
+void SheetSnapshot::PrintCells(std::ostream& out, Printer print) const {
+    for (int row = 0; row < size_.rows; ++row){
+        // Плитка ищется один раз на отрезок строки
+        for (int tile_col = 0; tile_col < size_.cols; tile_col += TILE_SIZE){
+            const FrozenSheet& tile = GetTile({row, tile_col});
+            const int end = std::min(tile_col + TILE_SIZE, size_.cols);
+            for (int col = tile_col; col < end; ++col){
+                print(*tile.GetCell({row, col}));
+                if (col < size_.cols - 1){
+                    out << '\t';
+                }
+            }
+        }
+        out << '\n';
+    }
+}
+
+void SheetSnapshot::PrintValues(std::ostream& out) const {
+    PrintCells(out, [&out](const CellInterface& cell){
+        std::visit([&out](auto&& element){out << element;}, cell.GetValue());
+    });
+}
+
+void SheetSnapshot::PrintTexts(std::ostream& out) const {
+    PrintCells(out, [&out](const CellInterface& cell){
+        out << cell.GetText();
+    });
+}
+
+std::optional<double> SheetSnapshot::GetNumber(Position pos) const {
+    return GetTile(pos).GetNumber(pos);
+}
+
+std::uint64_t SheetSnapshot::GetVersion() const {
+    return version_;
+}
+
+const SheetSnapshot::Tiles& SheetSnapshot::GetTiles() const {
+    return tiles_;
+}
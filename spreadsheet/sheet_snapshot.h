@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+#include "frozen_sheet.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <unordered_map>
+
+// Неизменяемая версия таблицы, полученная Sheet::Snapshot. Ячейки разбиты на
+// плитки TILE_SIZE x TILE_SIZE, каждая плитка - замороженная таблица из своих
+// ячеек. Следующая версия делит с предыдущей все плитки, в которых ничего не
+// менялось, поэтому стоит столько, сколько изменённые плитки.
+// Версию можно читать из любого числа потоков без блокировок, пока исходная
+// таблица продолжает меняться
+class SheetSnapshot : public SheetInterface {
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    // Номер строки плиток в старших 16 битах, номер столбца - в младших
+    using TileKey = std::uint32_t;
+    using Tile = std::shared_ptr<const FrozenSheet>;
+    using Tiles = std::unordered_map<TileKey, Tile>;
+
+    static TileKey GetTileKey(Position pos);
+    // Левый верхний угол плитки
+    static Position GetTileOrigin(TileKey key);
+
+    SheetSnapshot(Size size, std::uint64_t version, Tiles tiles);
+
+    // Бросают ReadOnlySheetException
+    void SetCell(Position pos, std::string text) override;
+    void ClearCell(Position pos) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& out) const override;
+    void PrintTexts(std::ostream& out) const override;
+
+    std::optional<double> GetNumber(Position pos) const override;
+
+    // Номера версий одной таблицы растут с каждым изменением
+    std::uint64_t GetVersion() const;
+
+    // Непустые плитки
+    const Tiles& GetTiles() const;
+
+private:
+    const FrozenSheet& GetTile(Position pos) const;
+
+    template <typename Printer>
+    void PrintCells(std::ostream& out, Printer print) const;
+
+    Size size_;
+    std::uint64_t version_;
+    Tiles tiles_;
+    // Отвечает за позиции, плиток которых нет
+    FrozenSheet empty_tile_;
+};
@@ -1,80 +1,75 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
+#include <cstdint>
 #include <algorithm>
+#include <unordered_map>
 
 
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
 const Position Position::NONE = {-1, -1};
 
 
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
 }
 
-bool Position::operator<(const Position rhs) const {
-    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+std::optional<double> ParseCellNumber(const std::string& text) {
+    try {
+        std::size_t end_pos{};
+        const double value = std::stod(text, &end_pos);
+        if (end_pos == text.size()) {
+            return value;
+        }
+    } catch (const std::exception&) {
+    }
+    return std::nullopt;
 }
 
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+bool Size::operator==(Size rhs) const {
+    return cols == rhs.cols && rows == rhs.rows;
 }
 
-std::string Position::ToString() const {
-    if (!IsValid()) {
-        return "";
-    }
-
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
-    }
-
-    result += std::to_string(row + 1);
-
-    return result;
+bool CellRange::operator==(CellRange rhs) const {
+    return first == rhs.first && last == rhs.last;
 }
 
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
-
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
-    }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
-        return Position::NONE;
-    }
-
-    if (!std::isdigit(digits[0])) {
-        return Position::NONE;
-    }
-
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
-    }
+bool CellRange::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row
+        && first.col <= pos.col && pos.col <= last.col;
+}
 
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
+int CellRange::GetHeightClass() const {
+    const int height = last.row - first.row + 1;
+    int height_class = 0;
+    while ((2 << height_class) <= height) {
+        ++height_class;
     }
-
-    return {row - 1, col - 1};
+    return height_class;
 }
 
-bool Size::operator==(Size rhs) const {
-    return cols == rhs.cols && rows == rhs.rows;
+std::vector<CellRange> CompressToRanges(std::vector<Position> positions) {
+    std::sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+
+    std::vector<CellRange> result;
+    // Отрезок столбцов [first.col, last.col] -> прямоугольник, который можно продолжить вниз
+    std::unordered_map<std::int64_t, size_t> open_ranges;
+    for (size_t i = 0; i < positions.size();) {
+        const Position first = positions[i];
+        Position last = first;
+        for (++i; i < positions.size() && positions[i].row == last.row
+                && positions[i].col == last.col + 1; ++i) {
+            last = positions[i];
+        }
+
+        const std::int64_t key = static_cast<std::int64_t>(first.col) * Position::MAX_COLS + last.col;
+        const auto it = open_ranges.find(key);
+        if (it != open_ranges.end() && result[it -> second].last.row == first.row - 1) {
+            result[it -> second].last.row = first.row;
+        } else {
+            open_ranges[key] = result.size();
+            result.push_back({first, last});
+        }
+    }
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+
+WorkerPool::~WorkerPool(){
+    {
+        std::lock_guard guard(mutex_);
+        stopping_ = true;
+    }
+    ready_.notify_all();
+    for (auto& thread : threads_){
+        thread.join();
+    }
+}
+
+void WorkerPool::Run(size_t helpers, const std::function<void()>& task){
+    Batch batch;
+    batch.task = &task;
+    if (helpers > 0){
+        {
+            std::lock_guard guard(mutex_);
+            while (threads_.size() < helpers){
+                threads_.emplace_back([this](){
+                    Work();
+                });
+            }
+            queue_.insert(queue_.end(), helpers, &batch);
+        }
+        ready_.notify_all();
+    }
+
+    task();
+
+    std::unique_lock lock(mutex_);
+    queue_.erase(std::remove(queue_.begin(), queue_.end(), &batch), queue_.end());
+    batch.done.wait(lock, [&batch](){
+        return batch.running == 0;
+    });
+}
+
+void WorkerPool::Work(){
+    std::unique_lock lock(mutex_);
+    while (true){
+        ready_.wait(lock, [this](){
+            return stopping_ || !queue_.empty();
+        });
+        if (stopping_){
+            return;
+        }
+        Batch* batch = queue_.front();
+        queue_.pop_front();
+        ++batch -> running;
+
+        lock.unlock();
+        (*batch -> task)();
+        lock.lock();
+
+        if (--batch -> running == 0){
+            batch -> done.notify_all();
+        }
+    }
+}
+
+WorkerPool& GetWorkerPool(){
+    static WorkerPool pool;
+    return pool;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Потоки, которые живут между вызовами, чтобы короткие параллельные задачи
+// не платили за создание и завершение потоков. Потоки создаются по мере
+// надобности и завершаются вместе с пулом
+class WorkerPool {
+public:
+    WorkerPool() = default;
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Выполняет task в вызывающем потоке и ещё не более чем в helpers
+    // потоках пула, возвращается, когда все копии завершились. task должна
+    // сама делить работу между копиями и не бросать исключений. Копии, до
+    // которых пул не дошёл, пока вызывающий поток работал, не запускаются
+    void Run(size_t helpers, const std::function<void()>& task);
+
+private:
+    struct Batch {
+        const std::function<void()>* task = nullptr;
+        // Сколько копий взяли потоки пула и ещё не завершили
+        size_t running = 0;
+        std::condition_variable done;
+    };
+
+    void Work();
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    // По одной записи на копию задачи, которую ещё не взял ни один поток
+    std::deque<Batch*> queue_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+};
+
+// Общий пул процесса
+WorkerPool& GetWorkerPool();